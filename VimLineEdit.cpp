@@ -14,7 +14,10 @@
 #include <QTextBlock>
 #include <QTextLayout>
 #include <QtWidgets/qtextedit.h>
+#include <atomic>
+#include <cmath>
 #include <cstdio>
+#include <cstring>
 #include <functional>
 #include <utility>
 #include <variant>
@@ -23,24 +26,1085 @@
 #include <QApplication>
 #include <QMenu>
 
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QThreadPool>
+#include <QTimer>
+
 namespace QVimEditor{
-const int SEARCH_HIGHLIGHT_PROPERTY_INDEX = 31;
+const int SEARCH_HIGHLIGHT_DELAY_MS = 30;
+
+
+class LineEditStyle : public QCommonStyle {
+    int font_width;
+
+  public:
+    LineEditStyle(int font_width) : font_width(font_width) {}
+
+    int pixelMetric(PixelMetric metric, const QStyleOption *option = 0,
+                    const QWidget *widget = 0) const {
+        if (metric == QStyle::PM_TextCursorWidth) {
+            return font_width;
+        }
+        return QCommonStyle::pixelMetric(metric, option, widget);
+    }
+};
+
+// ---------------------------------------------------------------------------------------------
+// vectorized search kernels. the SSE2/AVX2 versions are only compiled on x86, and the best one
+// which the CPU supports is selected the first time they are used.
+
+#if defined(__x86_64__) || defined(_M_X64) || (defined(__i386__) && defined(__SSE2__)) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VIM_LINE_EDIT_X86_KERNELS
+#endif
+
+#if defined(VIM_LINE_EDIT_X86_KERNELS) && (defined(__GNUC__) || defined(__clang__))
+#define VIM_LINE_EDIT_AVX2_KERNELS
+#define VIM_LINE_EDIT_TARGET_AVX2 __attribute__((target("avx2")))
+#elif defined(VIM_LINE_EDIT_X86_KERNELS) && defined(_MSC_VER)
+#define VIM_LINE_EDIT_AVX2_KERNELS
+#define VIM_LINE_EDIT_TARGET_AVX2
+#endif
+
+static int count_trailing_zeros(unsigned int mask) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+static int highest_set_bit(unsigned int mask) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long index;
+    _BitScanReverse(&index, mask);
+    return index;
+#else
+    return 31 - __builtin_clz(mask);
+#endif
+}
+
+static int find_char_scalar(const QChar *text, int size, QChar ch) {
+    for (int i = 0; i < size; i++) {
+        if (text[i] == ch) return i;
+    }
+    return -1;
+}
+
+static int find_last_char_scalar(const QChar *text, int size, QChar ch) {
+    for (int i = size - 1; i >= 0; i--) {
+        if (text[i] == ch) return i;
+    }
+    return -1;
+}
+
+static int find_substring_scalar(const QChar *text, int size, const QChar *needle, int needle_size) {
+    for (int i = 0; i + needle_size <= size; i++) {
+        if (text[i] == needle[0] && std::memcmp(text + i + 1, needle + 1, (needle_size - 1) * sizeof(QChar)) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+#ifdef VIM_LINE_EDIT_X86_KERNELS
+// each QChar is two bytes in the masks returned by movemask_epi8, so bit indices are divided by 2
+
+static int find_char_sse2(const QChar *text, int size, QChar ch) {
+    const __m128i target = _mm_set1_epi16(short(ch.unicode()));
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(chunk, target));
+        if (mask) return i + count_trailing_zeros(mask) / 2;
+    }
+    int index = find_char_scalar(text + i, size - i, ch);
+    return index == -1 ? -1 : i + index;
+}
+
+static int find_last_char_sse2(const QChar *text, int size, QChar ch) {
+    const __m128i target = _mm_set1_epi16(short(ch.unicode()));
+    int i = size;
+    for (; i >= 8; i -= 8) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i - 8));
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(chunk, target));
+        if (mask) return i - 8 + highest_set_bit(mask) / 2;
+    }
+    return find_last_char_scalar(text, i, ch);
+}
+
+// compare the first and the last character of the needle at 8 positions at once and only
+// check the whole needle at the positions where both of them match
+static int find_substring_sse2(const QChar *text, int size, const QChar *needle, int needle_size) {
+    const __m128i first = _mm_set1_epi16(short(needle[0].unicode()));
+    const __m128i last = _mm_set1_epi16(short(needle[needle_size - 1].unicode()));
+    int i = 0;
+    for (; i + needle_size - 1 + 8 <= size; i += 8) {
+        __m128i first_chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i));
+        __m128i last_chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(text + i + needle_size - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi16(first_chunk, first),
+                                                            _mm_cmpeq_epi16(last_chunk, last)));
+        while (mask) {
+            int index = i + count_trailing_zeros(mask) / 2;
+            if (std::memcmp(text + index + 1, needle + 1, (needle_size - 1) * sizeof(QChar)) == 0) {
+                return index;
+            }
+            mask &= mask - 1;
+            mask &= mask - 1;
+        }
+    }
+    int index = find_substring_scalar(text + i, size - i, needle, needle_size);
+    return index == -1 ? -1 : i + index;
+}
+#endif
+
+#ifdef VIM_LINE_EDIT_AVX2_KERNELS
+VIM_LINE_EDIT_TARGET_AVX2 static int find_char_avx2(const QChar *text, int size, QChar ch) {
+    const __m256i target = _mm256_set1_epi16(short(ch.unicode()));
+    int i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(chunk, target));
+        if (mask) return i + count_trailing_zeros(mask) / 2;
+    }
+    int index = find_char_sse2(text + i, size - i, ch);
+    return index == -1 ? -1 : i + index;
+}
+
+VIM_LINE_EDIT_TARGET_AVX2 static int find_last_char_avx2(const QChar *text, int size, QChar ch) {
+    const __m256i target = _mm256_set1_epi16(short(ch.unicode()));
+    int i = size;
+    for (; i >= 16; i -= 16) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + i - 16));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(chunk, target));
+        if (mask) return i - 16 + highest_set_bit(mask) / 2;
+    }
+    return find_last_char_sse2(text, i, ch);
+}
+
+VIM_LINE_EDIT_TARGET_AVX2 static int find_substring_avx2(const QChar *text, int size, const QChar *needle, int needle_size) {
+    const __m256i first = _mm256_set1_epi16(short(needle[0].unicode()));
+    const __m256i last = _mm256_set1_epi16(short(needle[needle_size - 1].unicode()));
+    int i = 0;
+    for (; i + needle_size - 1 + 16 <= size; i += 16) {
+        __m256i first_chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + i));
+        __m256i last_chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(text + i + needle_size - 1));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi16(first_chunk, first),
+                                                                  _mm256_cmpeq_epi16(last_chunk, last)));
+        while (mask) {
+            int index = i + count_trailing_zeros(mask) / 2;
+            if (std::memcmp(text + index + 1, needle + 1, (needle_size - 1) * sizeof(QChar)) == 0) {
+                return index;
+            }
+            mask &= mask - 1;
+            mask &= mask - 1;
+        }
+    }
+    int index = find_substring_sse2(text + i, size - i, needle, needle_size);
+    return index == -1 ? -1 : i + index;
+}
+
+static bool cpu_supports_avx2() {
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return false;
+    __cpuid(info, 1);
+    // the OS must save the AVX registers (OSXSAVE and AVX bits, then the XCR0 state bits)
+    if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0) return false;
+    if ((_xgetbv(0) & 6) != 6) return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+static bool is_search_kernel_supported(SearchKernel kernel) {
+    switch (kernel) {
+    case SearchKernel::Scalar:
+        return true;
+    case SearchKernel::SSE2:
+#ifdef VIM_LINE_EDIT_X86_KERNELS
+        return true;
+#else
+        return false;
+#endif
+    case SearchKernel::AVX2:
+#ifdef VIM_LINE_EDIT_AVX2_KERNELS
+        return cpu_supports_avx2();
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+static std::atomic<SearchKernel> &current_search_kernel() {
+    static std::atomic<SearchKernel> kernel(
+        is_search_kernel_supported(SearchKernel::AVX2) ? SearchKernel::AVX2 :
+        is_search_kernel_supported(SearchKernel::SSE2) ? SearchKernel::SSE2 :
+        SearchKernel::Scalar);
+    return kernel;
+}
+
+SearchKernel get_search_kernel() {
+    return current_search_kernel().load(std::memory_order_relaxed);
+}
+
+bool set_search_kernel(SearchKernel kernel) {
+    if (!is_search_kernel_supported(kernel)) return false;
+    current_search_kernel().store(kernel, std::memory_order_relaxed);
+    return true;
+}
+
+const char *get_search_kernel_name(SearchKernel kernel) {
+    switch (kernel) {
+    case SearchKernel::Scalar: return "scalar";
+    case SearchKernel::SSE2: return "sse2";
+    case SearchKernel::AVX2: return "avx2";
+    }
+    return "unknown";
+}
+
+int find_char(const QChar *text, int size, QChar ch) {
+    switch (get_search_kernel()) {
+#ifdef VIM_LINE_EDIT_AVX2_KERNELS
+    case SearchKernel::AVX2: return find_char_avx2(text, size, ch);
+#endif
+#ifdef VIM_LINE_EDIT_X86_KERNELS
+    case SearchKernel::SSE2: return find_char_sse2(text, size, ch);
+#endif
+    default: return find_char_scalar(text, size, ch);
+    }
+}
+
+int find_last_char(const QChar *text, int size, QChar ch) {
+    switch (get_search_kernel()) {
+#ifdef VIM_LINE_EDIT_AVX2_KERNELS
+    case SearchKernel::AVX2: return find_last_char_avx2(text, size, ch);
+#endif
+#ifdef VIM_LINE_EDIT_X86_KERNELS
+    case SearchKernel::SSE2: return find_last_char_sse2(text, size, ch);
+#endif
+    default: return find_last_char_scalar(text, size, ch);
+    }
+}
+
+int find_substring(const QChar *text, int size, const QChar *needle, int needle_size) {
+    if (needle_size <= 0) return size >= 0 ? 0 : -1;
+    if (needle_size == 1) return find_char(text, size, needle[0]);
+    if (needle_size > size) return -1;
+
+    switch (get_search_kernel()) {
+#ifdef VIM_LINE_EDIT_AVX2_KERNELS
+    case SearchKernel::AVX2: return find_substring_avx2(text, size, needle, needle_size);
+#endif
+#ifdef VIM_LINE_EDIT_X86_KERNELS
+    case SearchKernel::SSE2: return find_substring_sse2(text, size, needle, needle_size);
+#endif
+    default: return find_substring_scalar(text, size, needle, needle_size);
+    }
+}
+
+// same as text.indexOf(needle, from)
+static int index_of_substring(const QString &text, const QString &needle, int from = 0) {
+    if (from < 0 || from > text.size()) return -1;
+    int index = find_substring(text.constData() + from, text.size() - from, needle.constData(), needle.size());
+    return index == -1 ? -1 : from + index;
+}
+
+static void append_newline_positions(const QString &text, int offset, std::vector<int> &newlines) {
+    const QChar *data = text.constData();
+    int i = find_char(data, text.size(), '\n');
+    while (i != -1) {
+        newlines.push_back(offset + i);
+        int next = find_char(data + i + 1, text.size() - i - 1, '\n');
+        i = next == -1 ? -1 : i + 1 + next;
+    }
+}
+
+TextBuffer::TextBuffer(const QString &text) {
+    set_text(text);
+}
+
+void TextBuffer::set_text(const QString &text) {
+    original_text = text;
+    added_text.clear();
+    original_newlines.clear();
+    added_newlines.clear();
+    append_newline_positions(original_text, 0, original_newlines);
+
+    nodes.clear();
+    free_nodes.clear();
+    root = -1;
+    if (original_text.size() > 0) {
+        root = new_node(make_piece(false, 0, original_text.size()));
+    }
+    total_length = get_subtree_length(root);
+    total_newlines = get_subtree_newlines(root);
+
+    cached_text = original_text;
+    is_cached_text_valid = true;
+    revision++;
+}
+
+void TextBuffer::replace(int position, int chars_removed, const QString &text) {
+    if (chars_removed == 0 && text.size() == 0) {
+        return;
+    }
+
+    int before, rest, removed, after;
+    split(root, position, before, rest);
+    split(rest, chars_removed, removed, after);
+    remove_subtree(removed);
+
+    if (text.size() > 0) {
+        int start = added_text.size();
+        added_text.append(text);
+        append_newline_positions(text, start, added_newlines);
+
+        // typing appends to the previous insertion
+        if (!extend_last_piece(before, start, text.size())) {
+            before = merge(before, new_node(make_piece(true, start, text.size())));
+        }
+    }
+
+    root = merge(before, after);
+    total_length = get_subtree_length(root);
+    total_newlines = get_subtree_newlines(root);
+    is_cached_text_valid = false;
+    revision++;
+}
+
+int TextBuffer::size() const {
+    return total_length;
+}
+
+int TextBuffer::length() const {
+    return total_length;
+}
+
+QChar TextBuffer::at(int position) const {
+    if (position < 0 || position >= total_length) {
+        return QChar();
+    }
+
+    int piece_position;
+    int node = find_piece(position, piece_position);
+    return piece_data(nodes[node].piece)[position - piece_position];
+}
+
+QChar TextBuffer::operator[](int position) const {
+    return at(position);
+}
+
+QString TextBuffer::mid(int position, int length) const {
+    if (position < 0) {
+        if (length >= 0) {
+            length += position;
+        }
+        position = 0;
+    }
+    if (position >= total_length || length == 0) {
+        return "";
+    }
+    if (length < 0 || length > total_length - position) {
+        length = total_length - position;
+    }
+    if (is_cached_text_valid) {
+        return cached_text.mid(position, length);
+    }
+
+    QString result;
+    result.reserve(length);
+    visit_pieces_forward(root, 0, position, [&](const Piece &piece, int piece_position) {
+        int offset = std::max(position - piece_position, 0);
+        int count = std::min(piece.length - offset, length - static_cast<int>(result.size()));
+        result.append(piece_data(piece) + offset, count);
+        return result.size() < length;
+    });
+    return result;
+}
+
+QString TextBuffer::to_string() const {
+    if (!is_cached_text_valid) {
+        cached_text.clear();
+        cached_text.reserve(total_length);
+        visit_pieces_forward(root, 0, 0, [&](const Piece &piece, int piece_position) {
+            cached_text.append(piece_data(piece), piece.length);
+            return true;
+        });
+        is_cached_text_valid = true;
+    }
+    return cached_text;
+}
+
+int TextBuffer::index_of(QChar ch, int from) const {
+    if (from < 0) {
+        from = std::max(from + total_length, 0);
+    }
+    if (from >= total_length) {
+        return -1;
+    }
+
+    if (ch == '\n') {
+        int line = line_number(from);
+        return line < total_newlines ? newline_position(line) : -1;
+    }
+
+    int result = -1;
+    visit_pieces_forward(root, 0, from, [&](const Piece &piece, int piece_position) {
+        int start = std::max(from - piece_position, 0);
+        int i = find_char(piece_data(piece) + start, piece.length - start, ch);
+        if (i != -1) {
+            result = piece_position + start + i;
+            return false;
+        }
+        return true;
+    });
+    return result;
+}
+
+int TextBuffer::last_index_of(QChar ch, int from) const {
+    if (from < 0) {
+        from += total_length;
+    }
+    if (from >= total_length) {
+        from = total_length - 1;
+    }
+    if (from < 0) {
+        return -1;
+    }
+
+    if (ch == '\n') {
+        int line = line_number(from + 1);
+        return line > 0 ? newline_position(line - 1) : -1;
+    }
+
+    int result = -1;
+    visit_pieces_backward(root, 0, from, [&](const Piece &piece, int piece_position) {
+        int end = std::min(from - piece_position, piece.length - 1);
+        int i = find_last_char(piece_data(piece), end + 1, ch);
+        if (i != -1) {
+            result = piece_position + i;
+            return false;
+        }
+        return true;
+    });
+    return result;
+}
+
+int TextBuffer::line_count() const {
+    return total_newlines + 1;
+}
+
+int TextBuffer::line_number(int position) const {
+    if (position <= 0) {
+        return 0;
+    }
+    if (position >= total_length) {
+        return total_newlines;
+    }
+
+    int node = root;
+    int tree_position = 0;
+    int newlines_before = 0;
+    while (node != -1) {
+        const Node &current = nodes[node];
+        int piece_position = tree_position + get_subtree_length(current.left);
+        if (position < piece_position) {
+            node = current.left;
+            continue;
+        }
+
+        newlines_before += get_subtree_newlines(current.left);
+        if (position < piece_position + current.piece.length) {
+            const std::vector<int> &newlines = piece_newlines(current.piece);
+            auto begin = newlines.begin() + current.piece.first_newline;
+            auto end = begin + current.piece.newline_count;
+            int offset_in_buffer = current.piece.start + position - piece_position;
+            return newlines_before + (std::lower_bound(begin, end, offset_in_buffer) - begin);
+        }
+        newlines_before += current.piece.newline_count;
+        tree_position = piece_position + current.piece.length;
+        node = current.right;
+    }
+    return total_newlines;
+}
+
+int TextBuffer::newline_position(int index) const {
+    if (index < 0 || index >= total_newlines) {
+        return -1;
+    }
+
+    int node = root;
+    int tree_position = 0;
+    while (node != -1) {
+        const Node &current = nodes[node];
+        int left_newlines = get_subtree_newlines(current.left);
+        if (index < left_newlines) {
+            node = current.left;
+            continue;
+        }
+
+        index -= left_newlines;
+        int piece_position = tree_position + get_subtree_length(current.left);
+        if (index < current.piece.newline_count) {
+            int offset_in_buffer = piece_newlines(current.piece)[current.piece.first_newline + index];
+            return piece_position + offset_in_buffer - current.piece.start;
+        }
+        index -= current.piece.newline_count;
+        tree_position = piece_position + current.piece.length;
+        node = current.right;
+    }
+    return -1;
+}
+
+int TextBuffer::line_start_position(int position) const {
+    int line = line_number(position);
+    return line == 0 ? 0 : newline_position(line - 1) + 1;
+}
+
+int TextBuffer::line_end_position(int position) const {
+    int line = line_number(position);
+    return line < total_newlines ? newline_position(line) : total_length;
+}
+
+int TextBuffer::next_empty_line(int position) const {
+    // an empty line is a newline right after another newline, we only look at the newline index
+    int previous_newline = -2;
+    int result = -1;
+    visit_pieces_forward(root, 0, position, [&](const Piece &piece, int piece_position) {
+        const std::vector<int> &newlines = piece_newlines(piece);
+        auto begin = newlines.begin() + piece.first_newline;
+        auto end = begin + piece.newline_count;
+        for (auto it = std::lower_bound(begin, end, piece.start + position - piece_position); it != end; ++it) {
+            int newline = piece_position + *it - piece.start;
+            if (newline == previous_newline + 1) {
+                result = newline;
+                return false;
+            }
+            previous_newline = newline;
+        }
+        return true;
+    });
+    return result;
+}
+
+int TextBuffer::previous_empty_line(int position) const {
+    int next_newline = -1;
+    int result = -1;
+    visit_pieces_backward(root, 0, position - 1, [&](const Piece &piece, int piece_position) {
+        const std::vector<int> &newlines = piece_newlines(piece);
+        auto begin = newlines.begin() + piece.first_newline;
+        auto end = begin + piece.newline_count;
+        auto it = std::lower_bound(begin, end, piece.start + position - piece_position);
+        while (it != begin) {
+            --it;
+            int newline = piece_position + *it - piece.start;
+            if (newline + 1 == next_newline) {
+                result = next_newline;
+                return false;
+            }
+            next_newline = newline;
+        }
+        return true;
+    });
+    return result;
+}
+
+int TextBuffer::get_revision() const {
+    return revision;
+}
+
+TextBuffer::Piece TextBuffer::make_piece(bool is_added, int start, int length) const {
+    const std::vector<int> &newlines = is_added ? added_newlines : original_newlines;
+    int first_newline = std::lower_bound(newlines.begin(), newlines.end(), start) - newlines.begin();
+    int last_newline = std::lower_bound(newlines.begin() + first_newline, newlines.end(), start + length) - newlines.begin();
+    return Piece{is_added, start, length, first_newline, last_newline - first_newline};
+}
+
+const QChar *TextBuffer::piece_data(const Piece &piece) const {
+    return (piece.is_added ? added_text.constData() : original_text.constData()) + piece.start;
+}
+
+const std::vector<int> &TextBuffer::piece_newlines(const Piece &piece) const {
+    return piece.is_added ? added_newlines : original_newlines;
+}
+
+int TextBuffer::new_node(const Piece &piece) {
+    int node;
+    if (free_nodes.size() > 0) {
+        node = free_nodes.back();
+        free_nodes.pop_back();
+    }
+    else {
+        node = nodes.size();
+        nodes.push_back(Node());
+    }
+    // xorshift, the priorities only need to look random
+    next_priority ^= next_priority << 13;
+    next_priority ^= next_priority >> 17;
+    next_priority ^= next_priority << 5;
+    nodes[node] = Node{piece, next_priority};
+    update_node(node);
+    return node;
+}
+
+void TextBuffer::update_node(int node) {
+    Node &current = nodes[node];
+    current.subtree_length = get_subtree_length(current.left) + current.piece.length + get_subtree_length(current.right);
+    current.subtree_newlines = get_subtree_newlines(current.left) + current.piece.newline_count + get_subtree_newlines(current.right);
+}
+
+int TextBuffer::get_subtree_length(int tree) const {
+    return tree == -1 ? 0 : nodes[tree].subtree_length;
+}
+
+int TextBuffer::get_subtree_newlines(int tree) const {
+    return tree == -1 ? 0 : nodes[tree].subtree_newlines;
+}
+
+void TextBuffer::split(int tree, int position, int &before, int &after) {
+    if (tree == -1) {
+        before = after = -1;
+        return;
+    }
+
+    int left_length = get_subtree_length(nodes[tree].left);
+    int piece_length = nodes[tree].piece.length;
+    int left, right;
+    if (position <= left_length) {
+        split(nodes[tree].left, position, left, right);
+        nodes[tree].left = right;
+        update_node(tree);
+        before = left;
+        after = tree;
+    }
+    else if (position >= left_length + piece_length) {
+        split(nodes[tree].right, position - left_length - piece_length, left, right);
+        nodes[tree].right = left;
+        update_node(tree);
+        before = tree;
+        after = right;
+    }
+    else {
+        // `position` is inside this node's piece
+        Piece piece = nodes[tree].piece;
+        int offset = position - left_length;
+        int right_piece = new_node(make_piece(piece.is_added, piece.start + offset, piece.length - offset));
+        nodes[tree].piece = make_piece(piece.is_added, piece.start, offset);
+        right = nodes[tree].right;
+        nodes[tree].right = -1;
+        update_node(tree);
+        before = tree;
+        after = merge(right_piece, right);
+    }
+}
+
+int TextBuffer::merge(int before, int after) {
+    if (before == -1) return after;
+    if (after == -1) return before;
+
+    if (nodes[before].priority > nodes[after].priority) {
+        int right = merge(nodes[before].right, after);
+        nodes[before].right = right;
+        update_node(before);
+        return before;
+    }
+    else {
+        int left = merge(before, nodes[after].left);
+        nodes[after].left = left;
+        update_node(after);
+        return after;
+    }
+}
+
+void TextBuffer::remove_subtree(int tree) {
+    if (tree == -1) return;
+    remove_subtree(nodes[tree].left);
+    remove_subtree(nodes[tree].right);
+    free_nodes.push_back(tree);
+}
+
+bool TextBuffer::extend_last_piece(int tree, int start, int length) {
+    if (tree == -1) {
+        return false;
+    }
+
+    if (nodes[tree].right != -1) {
+        if (!extend_last_piece(nodes[tree].right, start, length)) {
+            return false;
+        }
+    }
+    else {
+        Piece piece = nodes[tree].piece;
+        if (!piece.is_added || piece.start + piece.length != start) {
+            return false;
+        }
+        nodes[tree].piece = make_piece(true, piece.start, piece.length + length);
+    }
+    update_node(tree);
+    return true;
+}
+
+int TextBuffer::find_piece(int position, int &piece_position) const {
+    // `position` has to be in [0, total_length)
+    if (last_piece_revision == revision && last_piece_node != -1 && last_piece_position <= position &&
+        position < last_piece_position + nodes[last_piece_node].piece.length) {
+        piece_position = last_piece_position;
+        return last_piece_node;
+    }
+
+    int node = root;
+    int tree_position = 0;
+    while (node != -1) {
+        const Node &current = nodes[node];
+        int current_position = tree_position + get_subtree_length(current.left);
+        if (position < current_position) {
+            node = current.left;
+        }
+        else if (position < current_position + current.piece.length) {
+            last_piece_node = node;
+            last_piece_position = current_position;
+            last_piece_revision = revision;
+            piece_position = current_position;
+            return node;
+        }
+        else {
+            tree_position = current_position + current.piece.length;
+            node = current.right;
+        }
+    }
+    piece_position = total_length;
+    return -1;
+}
+
+bool TextBuffer::visit_pieces_forward(int tree, int tree_position, int from, const std::function<bool(const Piece &, int)> &visit) const {
+    if (tree == -1) return true;
+
+    const Node &node = nodes[tree];
+    int piece_position = tree_position + get_subtree_length(node.left);
+    if (from < piece_position && !visit_pieces_forward(node.left, tree_position, from, visit)) {
+        return false;
+    }
+    if (from < piece_position + node.piece.length && !visit(node.piece, piece_position)) {
+        return false;
+    }
+    return visit_pieces_forward(node.right, piece_position + node.piece.length, from, visit);
+}
+
+bool TextBuffer::visit_pieces_backward(int tree, int tree_position, int from, const std::function<bool(const Piece &, int)> &visit) const {
+    if (tree == -1) return true;
+
+    const Node &node = nodes[tree];
+    int piece_position = tree_position + get_subtree_length(node.left);
+    if (from >= piece_position + node.piece.length &&
+        !visit_pieces_backward(node.right, piece_position + node.piece.length, from, visit)) {
+        return false;
+    }
+    if (from >= piece_position && !visit(node.piece, piece_position)) {
+        return false;
+    }
+    return visit_pieces_backward(node.left, tree_position, from, visit);
+}
+
+static const QString DEFAULT_ISKEYWORD = "@,48-57,_,192-255";
+
+WordClassifier::WordClassifier() {
+    // every editor starts with the same tables, so the default option is only parsed once
+    static const WordClassifier default_classifier(DEFAULT_ISKEYWORD);
+    *this = default_classifier;
+}
+
+WordClassifier::WordClassifier(const QString &option) {
+    set_iskeyword(option);
+}
+
+// a bound of an iskeyword range is either a character code or the character itself
+static bool parse_iskeyword_bound(const QString &text, int &code) {
+    bool ok;
+    int number = text.toInt(&ok);
+    if (ok && text[0].isDigit()) {
+        code = number;
+        return code < 256;
+    }
+    if (text.size() == 1 && text[0].unicode() < 256) {
+        code = text[0].unicode();
+        return true;
+    }
+    return false;
+}
+
+bool WordClassifier::set_iskeyword(const QString &option) {
+    std::array<bool, 256> is_keyword = {};
+
+    for (const QString &part : option.split(',')) {
+        if (part.isEmpty()) {
+            return false;
+        }
+
+        // ^ excludes the characters which were included by the previous parts
+        bool is_excluded = part.size() > 1 && part[0] == '^';
+        QString range = is_excluded ? part.mid(1) : part;
+
+        if (range == "@") {
+            for (int i = 0; i < 256; i++) {
+                if (QChar(i).isLetter()) {
+                    is_keyword[i] = !is_excluded;
+                }
+            }
+            continue;
+        }
+
+        int first, last;
+        int dash_index = range.indexOf('-', 1);
+        if (dash_index == -1) {
+            if (!parse_iskeyword_bound(range, first)) {
+                return false;
+            }
+            last = first;
+        }
+        else if (!parse_iskeyword_bound(range.left(dash_index), first) ||
+                 !parse_iskeyword_bound(range.mid(dash_index + 1), last) || first > last) {
+            return false;
+        }
+
+        for (int i = first; i <= last; i++) {
+            is_keyword[i] = !is_excluded;
+        }
+    }
+
+    for (int i = 0; i < 256; i++) {
+        if (QChar(i).isSpace()) {
+            latin1_classes[i] = CharClass::Space;
+        }
+        else {
+            latin1_classes[i] = is_keyword[i] ? CharClass::Word : CharClass::Punctuation;
+        }
+    }
+    iskeyword = option;
+    return true;
+}
+
+QString WordClassifier::get_iskeyword() const {
+    return iskeyword;
+}
+
+CharClass WordClassifier::get_class(QChar ch) const {
+    ushort code = ch.unicode();
+    if (code < 256) {
+        return latin1_classes[code];
+    }
+
+    // QChar's property lookups are a lot slower than a table lookup, so the classes of all the
+    // other characters are computed once and shared by all the editors
+    static const std::vector<CharClass> unicode_classes = []() {
+        std::vector<CharClass> classes(65536);
+        for (int i = 256; i < 65536; i++) {
+            QChar other(static_cast<char16_t>(i));
+            if (other.isSpace()) {
+                classes[i] = CharClass::Space;
+            }
+            else {
+                classes[i] = other.isLetterOrNumber() ? CharClass::Word : CharClass::Punctuation;
+            }
+        }
+        return classes;
+    }();
+    return unicode_classes[code];
+}
+
+bool WordClassifier::is_space(QChar ch) const {
+    return get_class(ch) == CharClass::Space;
+}
+
+bool WordClassifier::is_word(QChar ch) const {
+    return get_class(ch) == CharClass::Word;
+}
+
+void MarkTree::push(int node) {
+    int offset = nodes[node].lazy_offset;
+    if (offset == 0) return;
+
+    for (int child : {nodes[node].left, nodes[node].right}) {
+        if (child != -1) {
+            nodes[child].position += offset;
+            nodes[child].lazy_offset += offset;
+        }
+    }
+    nodes[node].lazy_offset = 0;
+}
+
+void MarkTree::set_child(int parent, bool is_left, int child) {
+    if (parent == -1) {
+        root = child;
+    }
+    else if (is_left) {
+        nodes[parent].left = child;
+    }
+    else {
+        nodes[parent].right = child;
+    }
+    if (child != -1) {
+        nodes[child].parent = parent;
+    }
+}
+
+void MarkTree::split(int tree, int position, int &before, int &after) {
+    if (tree == -1) {
+        before = after = -1;
+        return;
+    }
+
+    push(tree);
+    int left, right;
+    if (nodes[tree].position < position) {
+        split(nodes[tree].right, position, left, right);
+        set_child(tree, false, left);
+        before = tree;
+        after = right;
+    }
+    else {
+        split(nodes[tree].left, position, left, right);
+        set_child(tree, true, right);
+        before = left;
+        after = tree;
+    }
+    if (before != -1) nodes[before].parent = -1;
+    if (after != -1) nodes[after].parent = -1;
+}
+
+int MarkTree::merge(int before, int after) {
+    if (before == -1) return after;
+    if (after == -1) return before;
+
+    if (nodes[before].priority > nodes[after].priority) {
+        push(before);
+        set_child(before, false, merge(nodes[before].right, after));
+        return before;
+    }
+    else {
+        push(after);
+        set_child(after, true, merge(before, nodes[after].left));
+        return after;
+    }
+}
+
+void MarkTree::set(int name, int position) {
+    erase(name);
+
+    int node;
+    if (free_nodes.size() > 0) {
+        node = free_nodes.back();
+        free_nodes.pop_back();
+    }
+    else {
+        node = nodes.size();
+        nodes.push_back(Node());
+    }
+    // xorshift, the priorities only need to look random
+    next_priority ^= next_priority << 13;
+    next_priority ^= next_priority >> 17;
+    next_priority ^= next_priority << 5;
+    nodes[node] = Node{name, position, 0, next_priority};
+    node_by_name[name] = node;
+
+    int before, after;
+    split(root, position, before, after);
+    root = merge(merge(before, node), after);
+    nodes[root].parent = -1;
+}
+
+std::optional<int> MarkTree::get(int name) const {
+    auto it = node_by_name.find(name);
+    if (it == node_by_name.end()) return {};
+
+    int position = nodes[it->second].position;
+    for (int ancestor = nodes[it->second].parent; ancestor != -1; ancestor = nodes[ancestor].parent) {
+        position += nodes[ancestor].lazy_offset;
+    }
+    return position;
+}
 
+void MarkTree::erase(int name) {
+    auto it = node_by_name.find(name);
+    if (it == node_by_name.end()) return;
+    int node = it->second;
+    node_by_name.erase(it);
 
-class LineEditStyle : public QCommonStyle {
-    int font_width;
+    // apply the pending offsets from the root down to the node before relinking its children
+    std::vector<int> path;
+    for (int ancestor = node; ancestor != -1; ancestor = nodes[ancestor].parent) {
+        path.push_back(ancestor);
+    }
+    for (int i = path.size() - 1; i >= 0; i--) {
+        push(path[i]);
+    }
 
-  public:
-    LineEditStyle(int font_width) : font_width(font_width) {}
+    int parent = nodes[node].parent;
+    bool is_left = parent != -1 && nodes[parent].left == node;
+    set_child(parent, is_left, merge(nodes[node].left, nodes[node].right));
+    free_nodes.push_back(node);
+}
 
-    int pixelMetric(PixelMetric metric, const QStyleOption *option = 0,
-                    const QWidget *widget = 0) const {
-        if (metric == QStyle::PM_TextCursorWidth) {
-            return font_width;
-        }
-        return QCommonStyle::pixelMetric(metric, option, widget);
+int MarkTree::size() const {
+    return node_by_name.size();
+}
+
+void MarkTree::remove_subtree(int tree, std::vector<Mark> &removed) {
+    if (tree == -1) return;
+
+    push(tree);
+    removed.push_back(Mark{nodes[tree].position, nodes[tree].name});
+    node_by_name.erase(nodes[tree].name);
+    free_nodes.push_back(tree);
+    remove_subtree(nodes[tree].left, removed);
+    remove_subtree(nodes[tree].right, removed);
+}
+
+std::vector<Mark> MarkTree::update_for_edit(int begin, int end, int inserted_length) {
+    std::vector<Mark> removed;
+    if (root == -1) return removed;
+
+    int before, middle, after;
+    split(root, begin, before, after);
+    split(after, end, middle, after);
+    remove_subtree(middle, removed);
+
+    if (after != -1) {
+        nodes[after].position += inserted_length - (end - begin);
+        nodes[after].lazy_offset += inserted_length - (end - begin);
     }
-};
+    root = merge(before, after);
+    if (root != -1) nodes[root].parent = -1;
+    return removed;
+}
+
+void MarkTree::shift_after(int position, int offset) {
+    if (root == -1 || offset == 0) return;
+
+    int before, after;
+    split(root, position + 1, before, after);
+    if (after != -1) {
+        nodes[after].position += offset;
+        nodes[after].lazy_offset += offset;
+    }
+    root = merge(before, after);
+    nodes[root].parent = -1;
+}
 
 VimEditor::VimEditor(QWidget *editor_widget) : editor_widget(editor_widget) {
 
@@ -50,18 +1114,33 @@ VimEditor::VimEditor(QWidget *editor_widget) : editor_widget(editor_widget) {
     else{
         adapter = new QTextEditAdapter(dynamic_cast<QTextEdit*>(editor_widget));
     }
+    initialize();
+
+    // the command line, the search timer and the monospace font are created when they are first
+    // needed, most of the editors (e.g. in a form with many fields) never use them
+    set_style_for_mode(current_mode);
+}
+
+void VimEditor::set_monospace_font() {
+    if (is_monospace_font_set) return;
+    is_monospace_font_set = true;
+
+    // keep the font if the user has chosen one for this widget
+    if (editor_widget->testAttribute(Qt::WA_SetFont)) return;
 
     QFont font = editor_widget->font();
     font.setFamily("Courier New");
     font.setStyleHint(QFont::TypeWriter);
     editor_widget->setFont(font);
-    add_vim_keybindings();
+}
 
+void VimEditor::create_command_line_edit() {
     command_line_edit = new EscapeLineEdit(editor_widget);
-    command_line_edit->setFont(font);
+    command_line_edit->setFont(editor_widget->font());
     command_line_edit->hide();
 
     command_line_edit->setStyleSheet("background-color: #222222;");
+    update_command_line_edit_geometry();
 
     QObject::connect(command_line_edit, &EscapeLineEdit::returnPressed, [&](){
         QString text = command_line_edit->text();
@@ -83,22 +1162,196 @@ VimEditor::VimEditor(QWidget *editor_widget) : editor_widget(editor_widget) {
             highlight_matches(new_text.mid(1));
         }
     });
+}
+
+void VimEditor::update_command_line_edit_geometry() {
+    if (command_line_edit == nullptr) return;
 
+    // the command line is shown at the bottom of the editor
+    command_line_edit->resize(editor_widget->width(), command_line_edit->height());
+    command_line_edit->move(0, editor_widget->height() - command_line_edit->height());
+}
+
+VimEditor::VimEditor(TextInputAdapter *adapter) : adapter(adapter) {
+    initialize();
     set_style_for_mode(current_mode);
 }
 
+VimEditor::~VimEditor() {
+    // the search highlight results which are already queued for the GUI thread are dropped
+    (*search_highlight_generation)++;
+}
+
+void VimEditor::initialize() {
+    buffer.set_text(adapter->get_text());
+    adapter->text_changed_callback = [this](int position, int chars_removed, const QString &inserted_text) {
+        handle_adapter_text_change(position, chars_removed, inserted_text);
+    };
+    add_vim_keybindings();
+}
+
+void VimEditor::handle_key(int key, Qt::KeyboardModifiers modifiers, const QString &text) {
+    // feeds a key press to the editor as if it was typed by the user
+    QKeyEvent event(QEvent::KeyPress, key, modifiers, text);
+    if (editor_widget) {
+        bool is_command_line_visible = command_line_edit != nullptr && !command_line_edit->isHidden();
+        QWidget *target = is_command_line_visible ? command_line_edit : editor_widget;
+        QCoreApplication::sendEvent(target, &event);
+    }
+    else if (key_press_event(&event)) {
+        pass_key_to_adapter(&event);
+    }
+}
+
+void VimEditor::handle_headless_command_line_key(QKeyEvent *event) {
+    // a minimal version of what the command line widget does
+    QString &text = headless_command_line_text.value();
+    if (event->key() == Qt::Key_Escape) {
+        hide_command_line_edit();
+    }
+    else if (event->key() == Qt::Key_Return || event->key() == Qt::Key_Enter) {
+        QString command_text = text;
+        hide_command_line_edit();
+        perform_pending_text_command_with_text(command_text.mid(1));
+    }
+    else if (event->key() == Qt::Key_Backspace) {
+        text.chop(1);
+        if (text.size() == 0) {
+            // close the command line if the user deletes all text
+            hide_command_line_edit();
+        }
+    }
+    else {
+        text += event->text();
+    }
+}
+
+void VimEditor::get_visible_text_range(int &begin, int &end) {
+    QTextEditAdapter *text_adapter = dynamic_cast<QTextEditAdapter*>(get_untimed_adapter());
+    if (text_adapter == nullptr) {
+        // e.g. the highlight timer fired while a batch is open, the widget's text is not up to date
+        // so we can't ask it what is visible
+        begin = 0;
+        end = buffer.size();
+        return;
+    }
+
+    QWidget *viewport = text_adapter->text_edit->viewport();
+    int first_visible_position = text_adapter->text_edit->cursorForPosition(QPoint(0, 0)).position();
+    int last_visible_position = text_adapter->text_edit->cursorForPosition(QPoint(viewport->width(), viewport->height())).position();
+
+    // also include one screen above and below the viewport so that small scrolls don't need a new search
+    int first_visible_line = buffer.line_number(first_visible_position);
+    int last_visible_line = buffer.line_number(last_visible_position);
+    int margin = last_visible_line - first_visible_line + 1;
+
+    int first_line = std::max(first_visible_line - margin, 0);
+    int last_line = std::min(last_visible_line + margin, buffer.line_count() - 1);
+    begin = first_line == 0 ? 0 : buffer.newline_position(first_line - 1) + 1;
+    end = last_line == buffer.line_count() - 1 ? buffer.size() : buffer.newline_position(last_line);
+}
+
 void VimEditor::highlight_matches(QString pattern){
-    QTextEditAdapter *text_adapter = dynamic_cast<QTextEditAdapter*>(adapter);
+    QTextEditAdapter *text_adapter = dynamic_cast<QTextEditAdapter*>(get_untimed_adapter());
     if (text_adapter == nullptr) return;
 
-    QString current_text = adapter->get_text();
+    // cancel the previous search, we don't care about its results anymore
+    (*search_highlight_generation)++;
 
-    int first_index = 0;
+    if (pattern.size() == 0) {
+        if (search_highlight_timer) {
+            search_highlight_timer->stop();
+        }
+        search_highlight_state = {};
+        adapter->set_extra_selection_layer(SEARCH_SELECTION_LAYER, {});
+        return;
+    }
 
-    int next_index = current_text.indexOf(pattern, first_index);
+    // don't search on every keystroke when the user is typing fast
+    if (search_highlight_timer == nullptr) {
+        search_highlight_timer = new QTimer(editor_widget);
+        search_highlight_timer->setSingleShot(true);
+        QObject::connect(search_highlight_timer, &QTimer::timeout, [&](){
+            start_search_highlight_worker();
+        });
 
-    QList<QTextEdit::ExtraSelection> selections;
+        // only the visible part of the text is highlighted, so we search again when it is scrolled
+        if (QTextEdit *text_edit = dynamic_cast<QTextEdit*>(editor_widget)) {
+            QObject::connect(text_edit->verticalScrollBar(), &QScrollBar::valueChanged, [&](){
+                update_search_highlights_on_scroll();
+            });
+        }
+    }
+    pending_search_highlight_pattern = pattern;
+    search_highlight_timer->start(SEARCH_HIGHLIGHT_DELAY_MS);
+}
+
+void VimEditor::start_search_highlight_worker() {
+    QString pattern = pending_search_highlight_pattern;
+    int begin, end;
+    get_visible_text_range(begin, end);
+    int revision = buffer.get_revision();
+
+    bool is_same_range = search_highlight_state.has_value() &&
+                         search_highlight_state->begin == begin &&
+                         search_highlight_state->end == end &&
+                         search_highlight_state->buffer_revision == revision;
+
+    if (is_same_range && search_highlight_state->pattern == pattern) {
+        // nothing has changed
+        return;
+    }
 
+    // if the user typed more characters, the new matches are a subset of the old ones
+    bool only_check_previous_matches = is_same_range && pattern.startsWith(search_highlight_state->pattern);
+    std::vector<int> previous_matches;
+    if (only_check_previous_matches) {
+        previous_matches = search_highlight_state->match_positions;
+    }
+
+    // the worker only sees this copy of the text. matches which start in the range may end after it.
+    QString range_text = buffer.mid(begin, end - begin + pattern.size() - 1);
+    std::shared_ptr<std::atomic<int>> generation_counter = search_highlight_generation;
+    int generation = ++(*generation_counter);
+    QWidget *context = editor_widget;
+
+    QThreadPool::globalInstance()->start([this, context, generation_counter, generation, range_text, pattern, begin, end, revision,
+                                          only_check_previous_matches, previous_matches]() {
+        SearchHighlightState state;
+        state.pattern = pattern;
+        state.begin = begin;
+        state.end = end;
+        state.buffer_revision = revision;
+
+        if (only_check_previous_matches) {
+            for (int position : previous_matches) {
+                if (generation_counter->load() != generation) return;
+                if (range_text.mid(position - begin, pattern.size()) == pattern) {
+                    state.match_positions.push_back(position);
+                }
+            }
+        }
+        else {
+            int next_index = index_of_substring(range_text, pattern);
+            while (next_index != -1 && next_index < end - begin) {
+                if (generation_counter->load() != generation) return;
+                state.match_positions.push_back(begin + next_index);
+                next_index = index_of_substring(range_text, pattern, next_index + 1);
+            }
+        }
+
+        // `this` is only used on the GUI thread. the call is dropped if the widget is destroyed, and it
+        // does nothing if the editor is destroyed (the destructor changes the generation)
+        QMetaObject::invokeMethod(context, [this, generation_counter, generation, state]() {
+            if (generation_counter->load() != generation) return;
+            if (buffer.get_revision() != state.buffer_revision) return;
+            apply_search_highlights(state);
+        }, Qt::QueuedConnection);
+    });
+}
+
+void VimEditor::apply_search_highlights(SearchHighlightState state) {
+    QTextEditAdapter *text_adapter = dynamic_cast<QTextEditAdapter*>(get_untimed_adapter());
 
     QTextCharFormat search_highlight_format;
     QColor highlight_color = editor_widget->palette().color(QPalette::HighlightedText);
@@ -107,58 +1360,63 @@ void VimEditor::highlight_matches(QString pattern){
     search_highlight_format.setBackground(highlight_color);
     search_highlight_format.setForeground(inverted_highlight_color);
 
-    // identifier to distinguish search highlights from other highlights
-    search_highlight_format.setProperty(QTextFormat::UserProperty, SEARCH_HIGHLIGHT_PROPERTY_INDEX);
-
-    // search_highlight_format.setObjectType(int atype)
-
-    while (next_index != -1) {
-        int selection_begin = next_index;
-        int selection_end = next_index + pattern.length();
-
-        QTextCursor cursor = text_adapter->text_edit->textCursor();
-
-        cursor.setPosition(selection_begin, QTextCursor::MoveAnchor);
-        cursor.setPosition(selection_end, QTextCursor::KeepAnchor);
+    QList<QTextEdit::ExtraSelection> selections;
+    QTextCursor cursor = text_adapter->text_edit->textCursor();
+    for (int position : state.match_positions) {
+        cursor.setPosition(position, QTextCursor::MoveAnchor);
+        cursor.setPosition(position + state.pattern.length(), QTextCursor::KeepAnchor);
 
         QTextEdit::ExtraSelection selection;
         selection.cursor = cursor;
         selection.format = search_highlight_format;
-
-        QColor selection_foreground_color = text_adapter->text_edit->palette().color(QPalette::Text);
-        QColor selection_background_color = text_adapter->text_edit->palette().color(QPalette::Highlight);
-
-        // selection.format.setBackground(selection_background_color);
-        // selection.format.setForeground(selection_foreground_color);
-
         selections.append(selection);
+    }
 
+    adapter->set_extra_selection_layer(SEARCH_SELECTION_LAYER, selections);
+    search_highlight_state = std::move(state);
+}
 
-        // Find the next match
-        first_index = next_index + 1;
-        next_index = current_text.indexOf(pattern, first_index);
-    }
+void VimEditor::update_search_highlights_on_scroll() {
+    if (!search_highlight_state.has_value()) return;
 
-    QList<QTextEdit::ExtraSelection> old_extra_selections = adapter->get_extra_selections();
-    // QList<QTextEdit::ExtraSelection> old_selections_to_keep;
-    for (const QTextEdit::ExtraSelection& old_selection : old_extra_selections) {
-        // Restore the old selection format
-        // selection.format = search_highlight_format;
-        if (old_selection.format.property(QTextFormat::UserProperty).toInt() != SEARCH_HIGHLIGHT_PROPERTY_INDEX){
-            // old_selections_to_keep.append(old_selection);
-            selections.append(old_selection);
+    // don't bring back the highlights if they were cleared by another command
+    bool has_search_highlights = search_highlight_state->match_positions.empty() ||
+                                 !adapter->get_extra_selection_layer(SEARCH_SELECTION_LAYER).isEmpty();
 
-        }
+    if (has_search_highlights) {
+        highlight_matches(search_highlight_state->pattern);
+    }
+    else {
+        search_highlight_state = {};
     }
+}
 
-    adapter->set_extra_selections(selections);
+bool VimEditor::key_press_event(QKeyEvent *event) {
+    if (!metrics) {
+        return process_key_press_event(event);
+    }
 
+    QElapsedTimer timer;
+    timer.start();
+    qint64 adapter_ns_before = metrics->adapter_ns;
+    int buffer_size = buffer.size();
+    bool result = process_key_press_event(event);
+    // the metrics might have been disabled by the key press
+    if (metrics) {
+        metrics->key_presses.add_sample(timer.nsecsElapsed(), metrics->adapter_ns - adapter_ns_before, buffer_size);
+    }
+    return result;
 }
 
-bool VimEditor::key_press_event(QKeyEvent *event) {
+bool VimEditor::process_key_press_event(QKeyEvent *event) {
+
+    if (headless_command_line_text.has_value()) {
+        handle_headless_command_line_key(event);
+        return false;
+    }
 
     if (event->key() == Qt::Key_Return && current_mode == VimMode::Normal) {
-        if (dynamic_cast<QLineEditAdapter*>(adapter)){
+        if (dynamic_cast<QLineEdit*>(editor_widget)){
             return true;
         }
         else{
@@ -269,7 +1527,14 @@ bool VimEditor::key_press_event(QKeyEvent *event) {
                     return false;
                 }
             }
+            RecordedChange::Step text_object_step;
+            text_object_step.surrounding_scope = action_waiting_for_motion->surrounding_scope;
+            text_object_step.surrounding_kind = action_waiting_for_motion->surrounding_kind;
             if (handle_surrounding_motion_action()) {
+                if (pending_change.has_value() && !is_repeating_change) {
+                    pending_change->steps.push_back(text_object_step);
+                    update_pending_change();
+                }
                 return false;
             }
         }
@@ -312,26 +1577,37 @@ bool VimEditor::key_press_event(QKeyEvent *event) {
     }
 
     if (current_mode == VimMode::Insert){
-        current_insert_mode_text += event->text();
         int text_size = event->text().size();
 
         if (event->key() == Qt::Key_Backspace) {
             text_size = -1;
-            current_insert_mode_text = current_insert_mode_text.left(current_insert_mode_text.length() - 1);
+            current_insert_mode_text.chop(1);
         }
-
-        int current_position = get_cursor_position();
-        for (auto& [_, mark] : marks){
-            if (mark.position > current_position){
-                mark.position += text_size;
-            }
+        else if ((event->key() == Qt::Key_Return || event->key() == Qt::Key_Enter) && !dynamic_cast<QLineEdit*>(editor_widget)) {
+            // the event's text is "\r" but the widget inserts a newline, `.` should insert the same
+            text_size = 1;
+            current_insert_mode_text += "\n";
+        }
+        else {
+            current_insert_mode_text += event->text();
         }
+
+        marks.shift_after(get_cursor_position(), text_size);
     }
 
     return true;
 }
 
 void VimEditor::set_style_for_mode(VimMode mode) {
+    if (editor_widget == nullptr) {
+        // headless editors don't have a cursor to draw
+        return;
+    }
+
+    if (mode != VimMode::Insert) {
+        set_monospace_font();
+    }
+
     if (mode == VimMode::Normal) {
         // setStyleSheet("background-color: lightgray;");
         int font_width = adapter->get_font_metrics().horizontalAdvance(" ");
@@ -354,29 +1630,98 @@ void VimEditor::set_style_for_mode(VimMode mode) {
     }
 }
 
-void InputTreeNode::add_keybinding(const std::vector<KeyChord> &key_chords, int index,
-                                   VimLineEditCommand cmd) {
-    if (index >= key_chords.size()) {
-        command = cmd;
-        return;
+static int get_modifier_bits(const KeyboardModifierState &modifiers, bool ignore_shift) {
+    return (modifiers.shift && !ignore_shift ? 1 : 0) |
+           (modifiers.control ? 2 : 0) |
+           (modifiers.command ? 4 : 0) |
+           (modifiers.alt ? 8 : 0);
+}
+
+Keymap::Keymap() {
+    node_commands.push_back({});
+}
+
+quint64 Keymap::get_transition_key(int node, bool is_text, int modifiers, int key) {
+    return (quint64(node) << 37) | (quint64(is_text ? 1 : 0) << 36) | (quint64(modifiers) << 32) | quint32(key);
+}
+
+int Keymap::get_or_add_child(int node, const KeyChord &key_chord) {
+    int new_child = node_commands.size();
+    Transition new_transition{new_child, transition_count};
+
+    // text keys ignore shift, because it is already included in the text (e.g. "A")
+    if (std::holds_alternative<QString>(key_chord.key)) {
+        const QString &text = std::get<QString>(key_chord.key);
+        int modifiers = get_modifier_bits(key_chord.modifiers, true);
+        if (text.size() == 1) {
+            auto [it, inserted] = transitions.emplace(get_transition_key(node, true, modifiers, text[0].unicode()), new_transition);
+            if (!inserted) return it->second.child;
+        }
+        else {
+            for (const TextTransition &text_transition : text_transitions) {
+                if (text_transition.node == node && text_transition.modifiers == modifiers && text_transition.text == text) {
+                    return text_transition.transition.child;
+                }
+            }
+            text_transitions.push_back(TextTransition{node, text, modifiers, new_transition});
+        }
+    }
+    else {
+        int modifiers = get_modifier_bits(key_chord.modifiers, false);
+        auto [it, inserted] = transitions.emplace(get_transition_key(node, false, modifiers, std::get<int>(key_chord.key)), new_transition);
+        if (!inserted) return it->second.child;
     }
 
-    KeyChord current_chord = key_chords[index];
-    for (auto &child : children) {
-        if (child.key_chord.key == current_chord.key &&
-            equal_with_shift(child.key_chord.modifiers, current_chord.modifiers)) {
-            child.add_keybinding(key_chords, index + 1, cmd);
-            return;
+    transition_count++;
+    node_commands.push_back({});
+    return new_child;
+}
+
+void Keymap::add_keybinding(const std::vector<KeyChord> &key_chords, VimLineEditCommand command) {
+    int node = ROOT_NODE;
+    for (const KeyChord &key_chord : key_chords) {
+        node = get_or_add_child(node, key_chord);
+    }
+    node_commands[node] = command;
+}
+
+int Keymap::find_child(int node, const QString &event_text, int key, const KeyboardModifierState &modifiers) const {
+    const Transition *result = nullptr;
+
+    int text_modifiers = get_modifier_bits(modifiers, true);
+    if (event_text.size() == 1) {
+        auto it = transitions.find(get_transition_key(node, true, text_modifiers, event_text[0].unicode()));
+        if (it != transitions.end()) {
+            result = &it->second;
+        }
+    }
+    for (const TextTransition &text_transition : text_transitions) {
+        if (text_transition.node == node && text_transition.modifiers == text_modifiers && text_transition.text == event_text) {
+            if (result == nullptr || text_transition.transition.order < result->order) {
+                result = &text_transition.transition;
+            }
         }
     }
 
-    InputTreeNode new_node;
-    new_node.key_chord = current_chord;
-    new_node.add_keybinding(key_chords, index + 1, cmd);
-    children.push_back(new_node);
+    auto it = transitions.find(get_transition_key(node, false, get_modifier_bits(modifiers, false), key));
+    if (it != transitions.end() && (result == nullptr || it->second.order < result->order)) {
+        result = &it->second;
+    }
+
+    return result ? result->child : -1;
 }
 
-void VimEditor::add_vim_keybindings() {
+std::optional<VimLineEditCommand> Keymap::get_command(int node) const {
+    return node_commands[node];
+}
+
+struct DefaultKeymaps {
+    std::shared_ptr<const Keymap> normal_mode_keymap;
+    std::shared_ptr<const Keymap> visual_mode_keymap;
+    std::shared_ptr<const Keymap> insert_mode_keymap;
+};
+
+static DefaultKeymaps create_default_keymaps() {
     KeyboardModifierState CONTROL = KeyboardModifierState{false, true, false, false};
 
     // KeyboardModifierState SHIFT = KeyboardModifierState{true, false, false, false};
@@ -450,6 +1795,7 @@ void VimEditor::add_vim_keybindings() {
         KeyBinding{{KeyChord{"q", {}}}, VimLineEditCommand::RecordMacro},
         KeyBinding{{KeyChord{"\"", {}}}, VimLineEditCommand::SelectPasteRegister},
         KeyBinding{{KeyChord{"@", {}}}, VimLineEditCommand::RepeatMacro},
+        KeyBinding{{KeyChord{".", {}}}, VimLineEditCommand::RepeatLastChange},
         KeyBinding{{KeyChord{"*", {}}}, VimLineEditCommand::SearchTextUnderCursor},
         KeyBinding{{KeyChord{"#", {}}}, VimLineEditCommand::SearchTextUnderCursorBackward},
         KeyBinding{{KeyChord{"%", {}}}, VimLineEditCommand::GotoMatchingBracket},
@@ -463,11 +1809,12 @@ void VimEditor::add_vim_keybindings() {
         KeyBinding{{KeyChord{"K", {}}}, VimLineEditCommand::ViewDocumentation},
     };
 
+    auto normal_mode_keymap = std::make_shared<Keymap>();
     for (const auto &binding : key_bindings) {
-        normal_mode_input_tree.add_keybinding(binding.key_chords, 0, binding.command);
+        normal_mode_keymap->add_keybinding(binding.key_chords, binding.command);
     }
 
-    visual_mode_input_tree = normal_mode_input_tree.clone();
+    auto visual_mode_keymap = std::make_shared<Keymap>(*normal_mode_keymap);
     std::vector<KeyBinding> visual_mode_keybindings = {
         KeyBinding{{KeyChord{"o", {}}}, VimLineEditCommand::ToggleVisualCursor},
         KeyBinding{{KeyChord{"U", {}}}, VimLineEditCommand::Uppercasify},
@@ -475,9 +1822,10 @@ void VimEditor::add_vim_keybindings() {
     };
 
     for (const auto &binding : visual_mode_keybindings) {
-        visual_mode_input_tree.add_keybinding(binding.key_chords, 0, binding.command);
+        visual_mode_keymap->add_keybinding(binding.key_chords, binding.command);
     }
 
+    auto insert_mode_keymap = std::make_shared<Keymap>();
     std::vector<KeyBinding> insert_mode_keybindings = {
         KeyBinding{{KeyChord{Qt::Key_W, CONTROL}}, VimLineEditCommand::DeletePreviousWord},
         KeyBinding{{KeyChord{Qt::Key_A, CONTROL}}, VimLineEditCommand::InsertLastInsertModeText},
@@ -485,49 +1833,65 @@ void VimEditor::add_vim_keybindings() {
     };
 
     for (const auto &binding : insert_mode_keybindings) {
-        insert_mode_input_tree.add_keybinding(binding.key_chords, 0, binding.command);
+        insert_mode_keymap->add_keybinding(binding.key_chords, binding.command);
+    }
+
+    return DefaultKeymaps{normal_mode_keymap, visual_mode_keymap, insert_mode_keymap};
+}
+
+void VimEditor::add_vim_keybindings() {
+    // built only once, the keymaps are immutable so all the editors can use them
+    static const DefaultKeymaps default_keymaps = create_default_keymaps();
+    normal_mode_keymap = default_keymaps.normal_mode_keymap;
+    visual_mode_keymap = default_keymaps.visual_mode_keymap;
+    insert_mode_keymap = default_keymaps.insert_mode_keymap;
+    current_keymap_node = -1;
+}
+
+void VimEditor::add_keybinding(VimMode mode, const std::vector<KeyChord> &key_chords, VimLineEditCommand command) {
+    std::shared_ptr<const Keymap> *keymap = &normal_mode_keymap;
+    if (mode == VimMode::Visual || mode == VimMode::VisualLine) {
+        keymap = &visual_mode_keymap;
+    }
+    if (mode == VimMode::Insert) {
+        keymap = &insert_mode_keymap;
     }
 
+    // copy on write, other editors may be using the same keymap
+    auto new_keymap = std::make_shared<Keymap>(**keymap);
+    new_keymap->add_keybinding(key_chords, command);
+    *keymap = new_keymap;
+    current_keymap_node = -1;
 }
 
 std::optional<VimLineEditCommand> VimEditor::handle_key_event(QString event_text, int key,
                                                                 Qt::KeyboardModifiers modifiers) {
 
-    InputTreeNode* current_mode_root = &normal_mode_input_tree;
+    const Keymap* keymap = normal_mode_keymap.get();
     if (current_mode == VimMode::Visual || current_mode == VimMode::VisualLine) {
-        current_mode_root = &visual_mode_input_tree;
+        keymap = visual_mode_keymap.get();
     }
     if (current_mode == VimMode::Insert) {
-        current_mode_root = &insert_mode_input_tree;
+        keymap = insert_mode_keymap.get();
     }
-    InputTreeNode *node = current_node ? current_node : current_mode_root;
+    int node = current_keymap_node != -1 ? current_keymap_node : Keymap::ROOT_NODE;
     KeyboardModifierState modifier_state = KeyboardModifierState::from_qt_modifiers(modifiers);
-    for (auto &child : node->children) {
-        bool keys_are_equal = false;
 
-        std::function<bool(const KeyboardModifierState&, const KeyboardModifierState&)> comparator = equal_with_shift;
+    int child = keymap->find_child(node, event_text, key, modifier_state);
+    if (child == -1) {
+        // if no matching key chord is found, reset current_keymap_node
+        current_keymap_node = -1;
+        return {};
+    }
 
-        if (std::holds_alternative<QString>(child.key_chord.key)){
-            keys_are_equal = (std::get<QString>(child.key_chord.key) == event_text);
-            comparator = equal_withotu_shift;
-        }
-        else{
-            keys_are_equal = (std::get<int>(child.key_chord.key) == key);
-        }
-        if (keys_are_equal && comparator(child.key_chord.modifiers, modifier_state)) {
-            if (child.command.has_value()) {
-                current_node = nullptr;
-                return child.command;
-            }
-            else {
-                current_node = &child;
-                return {};
-            }
-        }
+    std::optional<VimLineEditCommand> command = keymap->get_command(child);
+    if (command.has_value()) {
+        current_keymap_node = -1;
     }
-    // if no matching key chord is found, reset current_node
-    current_node = nullptr;
-    return {};
+    else {
+        current_keymap_node = child;
+    }
+    return command;
 }
 
 QString get_initial_command_text(VimLineEditCommand cmd){
@@ -677,6 +2041,8 @@ QString to_string(VimLineEditCommand cmd) {
         return "SelectPasteRegister";
     case VimLineEditCommand::RepeatMacro:
         return "RepeatMacro";
+    case VimLineEditCommand::RepeatLastChange:
+        return "RepeatLastChange";
     case VimLineEditCommand::SearchTextUnderCursor:
         return "SearchTextUnderCursor";
     case VimLineEditCommand::SearchTextUnderCursorBackward:
@@ -728,7 +2094,166 @@ bool VimEditor::requires_symbol(VimLineEditCommand cmd) {
     }
 }
 
-void VimEditor::handle_command(VimLineEditCommand cmd, std::optional<char> symbol) {
+void VimEditor::handle_command(VimLineEditCommand cmd, std::optional<char> symbol) {
+    // counted edits (e.g. 500x or 200p) change the text once per repetition, the widget is only
+    // updated once at the end
+    bool is_counted_edit = current_command_repeat_number.toInt() > 1 &&
+                           (cmd == VimLineEditCommand::DeleteChar || cmd == VimLineEditCommand::DeleteCharAndEnterInsertMode ||
+                            cmd == VimLineEditCommand::PasteForward);
+
+    record_change_step(RecordedChange::Step{cmd, symbol, current_command_repeat_number});
+
+    if (!metrics && !is_counted_edit) {
+        execute_command(cmd, symbol);
+        update_pending_change();
+        return;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    qint64 adapter_ns_before = metrics ? metrics->adapter_ns : 0;
+    int buffer_size = buffer.size();
+    if (is_counted_edit) {
+        begin_batch();
+    }
+    execute_command(cmd, symbol);
+    if (is_counted_edit) {
+        end_batch();
+    }
+    if (metrics) {
+        metrics->commands[cmd].add_sample(timer.nsecsElapsed(), metrics->adapter_ns - adapter_ns_before, buffer_size);
+    }
+    update_pending_change();
+}
+
+bool VimEditor::is_change_command(VimLineEditCommand cmd) const {
+    switch (cmd) {
+    case VimLineEditCommand::EnterInsertMode:
+    case VimLineEditCommand::EnterInsertModeAfter:
+    case VimLineEditCommand::EnterInsertModeBegin:
+    case VimLineEditCommand::EnterInsertModeEnd:
+    case VimLineEditCommand::EnterInsertModeBeginLine:
+    case VimLineEditCommand::EnterInsertModeEndLine:
+    case VimLineEditCommand::DeleteChar:
+    case VimLineEditCommand::Delete:
+    case VimLineEditCommand::Change:
+    case VimLineEditCommand::DeleteToEndOfLine:
+    case VimLineEditCommand::ChangeToEndOfLine:
+    case VimLineEditCommand::PasteForward:
+    case VimLineEditCommand::PasteBackward:
+    case VimLineEditCommand::InsertLineBelow:
+    case VimLineEditCommand::InsertLineAbove:
+    case VimLineEditCommand::DeleteCharAndEnterInsertMode:
+    case VimLineEditCommand::DeleteCurrentLine:
+    case VimLineEditCommand::ChangeCurrentLine:
+    case VimLineEditCommand::IncrementNextNumberOnCurrentLine:
+    case VimLineEditCommand::DecrementNextNumberOnCurrentLine:
+    case VimLineEditCommand::SwapCaseCharacterUnderCursor:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void VimEditor::record_change_step(RecordedChange::Step step) {
+    if (is_repeating_change) {
+        return;
+    }
+
+    // an operator which didn't get its motion (e.g. dd is recorded as d and then DeleteCurrentLine)
+    if (pending_change.has_value() && current_mode == VimMode::Normal && !action_waiting_for_motion.has_value()) {
+        pending_change = {};
+    }
+
+    // starting or stopping a macro in the middle of a change is not a part of the change
+    bool is_macro_command = step.command == VimLineEditCommand::RecordMacro || step.command == VimLineEditCommand::RepeatMacro ||
+                            step.command == VimLineEditCommand::RepeatLastChange;
+
+    if (pending_change.has_value()) {
+        // the commands in the insert mode (e.g. <C-w>) are already included in the inserted text
+        if (current_mode == VimMode::Normal && !is_macro_command) {
+            pending_change->steps.push_back(step);
+        }
+        return;
+    }
+
+    // e.g. the x in yx doesn't start a change because it is executed while y is waiting for its motion
+    bool is_operator = step.command == VimLineEditCommand::Delete || step.command == VimLineEditCommand::Change;
+    if (current_mode == VimMode::Normal && step.command.has_value() && is_change_command(step.command.value()) &&
+        (!action_waiting_for_motion.has_value() || is_operator)) {
+        pending_change = RecordedChange{};
+        pending_change->paste_register = current_paste_register;
+        pending_change->steps.push_back(step);
+    }
+}
+
+void VimEditor::update_pending_change() {
+    if (is_repeating_change || !pending_change.has_value()) {
+        return;
+    }
+
+    if (current_mode == VimMode::Insert) {
+        pending_change->enters_insert_mode = true;
+    }
+    else if (current_mode != VimMode::Normal) {
+        pending_change = {};
+    }
+    else if (!action_waiting_for_motion.has_value()) {
+        if (pending_change->enters_insert_mode) {
+            pending_change->inserted_text = last_insert_mode_text;
+        }
+        last_change = std::move(pending_change);
+        pending_change = {};
+    }
+}
+
+void VimEditor::repeat_last_change(int num_repeats) {
+    if (!last_change.has_value() || is_repeating_change || current_mode != VimMode::Normal ||
+        action_waiting_for_motion.has_value()) {
+        return;
+    }
+
+    RecordedChange change = last_change.value();
+    // a count given to . replaces the count of the change, e.g. 3. after 2x deletes 3 characters
+    if (num_repeats > 1) {
+        change.steps[0].repeat_number = QString::number(num_repeats);
+    }
+
+    // the steps are applied to the buffer directly and the widget is only updated at the end
+    is_repeating_change = true;
+    begin_batch();
+    push_current_history_state();
+    current_paste_register = change.paste_register;
+
+    for (const RecordedChange::Step &step : change.steps) {
+        if (step.command.has_value()) {
+            current_command_repeat_number = step.repeat_number;
+            handle_command(step.command.value(), step.symbol);
+        }
+        else if (action_waiting_for_motion.has_value()) {
+            action_waiting_for_motion->surrounding_scope = step.surrounding_scope;
+            action_waiting_for_motion->surrounding_kind = step.surrounding_kind;
+            handle_surrounding_motion_action();
+        }
+    }
+
+    if (current_mode == VimMode::Insert) {
+        if (change.inserted_text.size() > 0) {
+            int cursor_position = get_cursor_position();
+            insert_text(change.inserted_text, cursor_position);
+            set_cursor_position(cursor_position + change.inserted_text.size());
+        }
+        current_insert_mode_text = change.inserted_text;
+        handle_command(VimLineEditCommand::EnterNormalMode);
+    }
+    // in case the motion of the operator couldn't be applied to the current text
+    action_waiting_for_motion = {};
+
+    end_batch();
+    is_repeating_change = false;
+}
+
+void VimEditor::execute_command(VimLineEditCommand cmd, std::optional<char> symbol) {
 
     // don't handle the 0 key while we are typing a repeat number
     if (cmd == VimLineEditCommand::MoveToBeginningOfLine && current_command_repeat_number.size() > 1) {
@@ -755,9 +2280,8 @@ void VimEditor::handle_command(VimLineEditCommand cmd, std::optional<char> symbo
     int delete_pos_offset = 0;
 
     HistoryState current_state;
-    current_state.text = adapter->get_text();
     current_state.cursor_position = old_pos;
-    current_state.marks = marks;
+    int old_text_size = buffer.size();
     bool should_reset_desired_pos = true;
 
     switch (cmd) {
@@ -770,8 +2294,8 @@ void VimEditor::handle_command(VimLineEditCommand cmd, std::optional<char> symbo
         int current_pos = get_cursor_position();
 
         bool is_ony_empty_line = false;
-        if (current_pos >= 0 && current_pos < current_state.text.length()) {
-            if (current_state.text[current_pos] == '\n'){
+        if (current_pos >= 0 && current_pos < buffer.length()) {
+            if (buffer[current_pos] == '\n'){
                 is_ony_empty_line = true;
             }
         }
@@ -787,7 +2311,7 @@ void VimEditor::handle_command(VimLineEditCommand cmd, std::optional<char> symbo
         break;
     case VimLineEditCommand::EnterInsertModeEnd:
         set_mode(VimMode::Insert);
-        new_pos = current_state.text.length();
+        new_pos = buffer.length();
         break;
     case VimLineEditCommand::Uppercasify: {
         int begin, end;
@@ -829,6 +2353,9 @@ void VimEditor::handle_command(VimLineEditCommand cmd, std::optional<char> symbo
     case VimLineEditCommand::SelectPasteRegister:
         current_paste_register = symbol.value();
         break;
+    case VimLineEditCommand::RepeatLastChange:
+        repeat_last_change(num_repeats);
+        break;
     case VimLineEditCommand::RepeatMacro: {
         int macro_symbol = symbol.value();
 
@@ -838,15 +2365,20 @@ void VimEditor::handle_command(VimLineEditCommand cmd, std::optional<char> symbo
 
         if (macros.find(macro_symbol) != macros.end()){
             Macro& macro = macros[macro_symbol];
+            // replaying the keys on the widget would update it after every key, instead we replay them
+            // on a copy of the text and update the widget once at the end
+            begin_batch();
+            push_current_history_state();
             for (int j = 0; j < num_repeats; j++){
                 for (int i = 0; i < macro.events.size(); i++) {
                     auto clone = macro.events[i].get()->clone();
                     if (key_press_event(clone)){
-                        adapter->key_press_event(clone);
+                        pass_key_to_adapter(clone);
                     }
                     delete clone;
                 }
             }
+            end_batch();
             last_macro_symbol = macro_symbol;
         }
         break;
@@ -880,7 +2412,7 @@ void VimEditor::handle_command(VimLineEditCommand cmd, std::optional<char> symbo
         break;
     case VimLineEditCommand::GotoEnd:
         if (num_repeats <= 1){
-            new_pos = get_line_end_position(current_state.text.length());
+            new_pos = get_line_end_position(buffer.length());
         }
         else {
             new_pos = get_ith_line_start_position(num_repeats - 1);
@@ -896,22 +2428,23 @@ void VimEditor::handle_command(VimLineEditCommand cmd, std::optional<char> symbo
         break;
     }
     case VimLineEditCommand::MoveToTheNextParagraph:{
-        int next_paragraph_start = current_state.text.indexOf("\n\n", get_cursor_position());
-        if (next_paragraph_start == -1) {
-            new_pos = current_state.text.length();
+        int next_empty_line = buffer.next_empty_line(get_cursor_position());
+        if (next_empty_line == -1) {
+            new_pos = buffer.length();
         }
         else {
-            new_pos = next_paragraph_start + 1;
+            new_pos = next_empty_line;
         }
         break;
     }
     case VimLineEditCommand::MoveToThePreviousParagraph:{
-        int previous_paragraph_end = current_state.text.mid(0, get_cursor_position()-1).lastIndexOf("\n\n");
-        if (previous_paragraph_end == -1 || previous_paragraph_end > get_cursor_position()) {
+        // the empty line has to end before the character before the cursor
+        int previous_empty_line = buffer.previous_empty_line(get_cursor_position() - 1);
+        if (previous_empty_line == -1) {
             new_pos = 0;
         }
         else {
-            new_pos = previous_paragraph_end + 1;
+            new_pos = previous_empty_line;
         }
         break;
     }
@@ -961,12 +2494,12 @@ void VimEditor::handle_command(VimLineEditCommand cmd, std::optional<char> symbo
     }
     case VimLineEditCommand::EnterNormalMode: {
         if (visual_line_selection_begin != -1){
-            adapter->set_extra_selections(QList<QTextEdit::ExtraSelection>());
+            adapter->set_extra_selection_layer(VISUAL_SELECTION_LAYER, {});
             visual_line_selection_begin = -1;
             visual_line_selection_end = -1;
         }
         if (current_mode == VimMode::Visual){
-            adapter->set_extra_selections(QList<QTextEdit::ExtraSelection>());
+            adapter->set_extra_selection_layer(VISUAL_SELECTION_LAYER, {});
         }
 
         VimMode previous_mode = current_mode;
@@ -985,7 +2518,7 @@ void VimEditor::handle_command(VimLineEditCommand cmd, std::optional<char> symbo
         // characters Move cursor back by one position unless we're already at
         // the beginning of a line
         if (previous_mode == VimMode::Insert){
-            bool is_at_beginning_of_line = (new_pos > 0 && current_state.text[new_pos - 1] == '\n');
+            bool is_at_beginning_of_line = (new_pos > 0 && buffer[new_pos - 1] == '\n');
             if (get_cursor_position() > 0) {
                 if (!is_at_beginning_of_line) {
                     new_pos = get_cursor_position() - 1;
@@ -1009,26 +2542,28 @@ void VimEditor::handle_command(VimLineEditCommand cmd, std::optional<char> symbo
     case VimLineEditCommand::EnterVisualLineMode:
         set_mode(VimMode::VisualLine);
         visual_mode_anchor = get_cursor_position();
+        // create the selection again, e.g. in case the palette has changed
+        visual_line_selection.cursor = QTextCursor();
         // Immediately select the current line
         set_cursor_position_with_line_selection(get_cursor_position());
         break;
     case VimLineEditCommand::MoveLeft: {
         int old_pos = get_cursor_position();
         new_pos = old_pos - num_repeats;
-        if (new_pos >= 0 && current_state.text[new_pos] == '\n') {
+        if (new_pos >= 0 && buffer[new_pos] == '\n') {
             new_pos = old_pos;
         }
         break;
     }
     case VimLineEditCommand::MoveRight: {
         int old_pos = get_cursor_position();
-        if ((get_cursor_position() + num_repeats - 1) < current_state.text.length()) {
+        if ((get_cursor_position() + num_repeats - 1) < buffer.length()) {
             new_pos = get_cursor_position() + num_repeats;
         }
         else {
-            new_pos = current_state.text.length();
+            new_pos = buffer.length();
         }
-        if (new_pos < current_state.text.length() && current_state.text[new_pos] == '\n') {
+        if (new_pos < buffer.length() && buffer[new_pos] == '\n') {
             new_pos = old_pos;
         }
         break;
@@ -1112,7 +2647,7 @@ void VimEditor::handle_command(VimLineEditCommand cmd, std::optional<char> symbo
         int cursor_offset = cmd == VimLineEditCommand::DeleteToEndOfLine ? -1 : 0;
         
         if (cursor_pos < line_end) {
-            set_last_deleted_text(current_state.text.mid(cursor_pos, line_end - cursor_pos), current_paste_register);
+            set_last_deleted_text(buffer.mid(cursor_pos, line_end - cursor_pos), current_paste_register);
             remove_text(cursor_pos, line_end - cursor_pos);
             set_cursor_position(cursor_pos + cursor_offset);
         }
@@ -1128,17 +2663,13 @@ void VimEditor::handle_command(VimLineEditCommand cmd, std::optional<char> symbo
         break;
     }
     case VimLineEditCommand::SetMark: {
-        Mark mark;
-        mark.name = symbol.value();
-        mark.position = get_cursor_position();
-        marks[symbol.value()] = mark;
+        marks.set(symbol.value(), get_cursor_position());
         break;
     }
     case VimLineEditCommand::GotoMark: {
-        if (marks.find(symbol.value()) != marks.end()) {
-            Mark mark = marks[symbol.value()];
+        if (std::optional<int> mark_position = marks.get(symbol.value())) {
             // move the cursor to the mark location
-            new_pos = mark.position;
+            new_pos = mark_position.value();
         }
         break;
     }
@@ -1185,7 +2716,7 @@ void VimEditor::handle_command(VimLineEditCommand cmd, std::optional<char> symbo
         int line_start = get_line_start_position(cursor_pos);
         int line_end = get_line_end_position(cursor_pos);
 
-        set_last_deleted_text(current_state.text.mid(line_start, line_end - line_start), current_paste_register, true);
+        set_last_deleted_text(buffer.mid(line_start, line_end - line_start), current_paste_register, true);
 
         if (cmd != VimLineEditCommand::YankCurrentLine){
 
@@ -1197,7 +2728,7 @@ void VimEditor::handle_command(VimLineEditCommand cmd, std::optional<char> symbo
             remove_text(line_start, line_end - line_start);
 
             // if we delete the last line, we need to move the cursor to the previous line
-            if (line_end >= current_state.text.size()) {
+            if (line_end >= old_text_size) {
                 set_cursor_position(line_start - 1);
             }
             else {
@@ -1215,7 +2746,6 @@ void VimEditor::handle_command(VimLineEditCommand cmd, std::optional<char> symbo
         push_history(current_state);
         std::optional<LastDeletedTextState> last_deleted_text = get_last_deleted_text(current_paste_register);
         if (last_deleted_text && last_deleted_text->text.size() > 0) {
-            QString current_text = current_state.text;
             int cursor_pos = get_cursor_position();
 
             for (int i = 0; i < num_repeats; i++){
@@ -1240,7 +2770,6 @@ void VimEditor::handle_command(VimLineEditCommand cmd, std::optional<char> symbo
         push_history(current_state);
         std::optional<LastDeletedTextState> last_deleted_text = get_last_deleted_text(current_paste_register);
         if (last_deleted_text && last_deleted_text->text.size() > 0) {
-            QString current_text = current_state.text;
             int cursor_pos = get_cursor_position();
 
             if (last_deleted_text->is_line) {
@@ -1258,7 +2787,6 @@ void VimEditor::handle_command(VimLineEditCommand cmd, std::optional<char> symbo
     }
     case VimLineEditCommand::InsertLineBelow: {
         push_history(current_state);
-        QString current_text = current_state.text;
         int cursor_pos = get_cursor_position();
         int line_end = get_line_end_position(cursor_pos);
         insert_text("\n", line_end);
@@ -1267,11 +2795,19 @@ void VimEditor::handle_command(VimLineEditCommand cmd, std::optional<char> symbo
         break;
     }
     case VimLineEditCommand::DeletePreviousWord: {
-        QString current_text = current_state.text;
         int cursor_pos = get_cursor_position();
+        // index of the last character at or before `from` which is (not) a space, -1 if there is none
+        auto last_index_of_space = [&](int from, bool is_space) {
+            for (int i = std::min(from, buffer.size() - 1); i >= 0; i--) {
+                if (buffer[i].isSpace() == is_space) {
+                    return i;
+                }
+            }
+            return -1;
+        };
         // find the last space or newline
-        int previous_space_index = current_text.lastIndexOf(QRegularExpression("\\s"), std::max(cursor_pos - 2, 0));
-        int previous_non_space_index = current_text.lastIndexOf(QRegularExpression("\\S"), std::max(previous_space_index - 1, 0));
+        int previous_space_index = last_index_of_space(std::max(cursor_pos - 2, 0), true);
+        int previous_non_space_index = last_index_of_space(std::max(previous_space_index - 1, 0), false);
 
         if (cursor_pos-1 == previous_non_space_index){
             break;
@@ -1300,7 +2836,6 @@ void VimEditor::handle_command(VimLineEditCommand cmd, std::optional<char> symbo
     }
     case VimLineEditCommand::InsertLineAbove: {
         push_history(current_state);
-        QString current_text = current_state.text;
         int cursor_pos = get_cursor_position();
         int line_start = get_line_start_position(cursor_pos);
         insert_text("\n", line_start);
@@ -1329,64 +2864,26 @@ void VimEditor::handle_command(VimLineEditCommand cmd, std::optional<char> symbo
     }
     case VimLineEditCommand::SwapCaseCharacterUnderCursor: {
         int cursor_pos = get_cursor_position();
-        if (cursor_pos < 0 || cursor_pos >= current_state.text.length()) {
+        if (cursor_pos < 0 || cursor_pos >= buffer.length()) {
             break;
         }
 
-        QChar current_char = current_state.text[cursor_pos];
+        QChar current_char = buffer[cursor_pos];
         if (current_char.isLetter()) {
             // Swap case of the character under the cursor
-            QString new_text = current_state.text;
-            if (current_char.isUpper()) {
-                new_text[cursor_pos] = current_char.toLower();
-            } else {
-                new_text[cursor_pos] = current_char.toUpper();
-            }
-            adapter->set_text(new_text);
+            QChar new_char = current_char.isUpper() ? current_char.toLower() : current_char.toUpper();
+            insert_text(QString(new_char), cursor_pos, cursor_pos + 1, false);
         }
-        if (cursor_pos < current_state.text.length()) {
+        if (cursor_pos < buffer.length()) {
             new_pos = cursor_pos + 1;
         }
         break;
     }
     case VimLineEditCommand::GotoMatchingBracket: {
-        int cursor_pos = get_cursor_position();
-        std::unordered_map<int, int> matching_brackets = {
-            {'(', ')'},
-            {')', '('},
-            {'{', '}'},
-            {'}', '{'},
-            {'[', ']'},
-            {']', '['},
-            {'<', '>'},
-            {'>', '<'}
-        };
-        std::vector<int> opening_brackets = {'(', '{', '[', '<'};
-
-        if (cursor_pos < 0 || cursor_pos >= current_state.text.length()) {
-            break;
-        }
-        QChar current_char = current_state.text[cursor_pos];
-        if (matching_brackets.find(current_char.unicode()) == matching_brackets.end()) {
-            // not a bracket
-            break;
-        }
-        int target_pos = -1;
-        int bracket_count = 0;
-        char target_bracket = matching_brackets[current_char.unicode()];
-        bool is_opening_bracket = std::find(opening_brackets.begin(), opening_brackets.end(), current_char.unicode()) != opening_brackets.end();
-        if (is_opening_bracket){
-            target_pos = current_state.text.indexOf(target_bracket, cursor_pos + 1);
-        }
-        else{
-            target_pos = current_state.text.lastIndexOf(target_bracket, cursor_pos - 1);
-        }
-
+        int target_pos = find_matching_bracket(get_cursor_position());
         if (target_pos != -1) {
             new_pos = target_pos;
         }
-
-
         break;
     }
     case VimLineEditCommand::ToggleVisualCursor: {
@@ -1441,7 +2938,6 @@ void VimEditor::handle_command(VimLineEditCommand cmd, std::optional<char> symbo
         QString selected_text = get_current_selection(selection_begin, selection_end);
 
         if (current_mode == VimMode::Visual) {
-            auto selections = adapter->get_extra_selections();
             set_last_deleted_text(selected_text, current_paste_register);
             if (cmd !=  VimLineEditCommand::Yank) {
                 // int start_pos = cursor.selectionStart();
@@ -1452,13 +2948,13 @@ void VimEditor::handle_command(VimLineEditCommand cmd, std::optional<char> symbo
         if (current_mode == VimMode::VisualLine) {
             int start = visual_line_selection_begin;
             int end = visual_line_selection_end;
-            int offset = (end == current_state.text.size()) ? 1 : 0;
-            if (current_state.text[end-1] == '\n') {
+            int offset = (end == buffer.size()) ? 1 : 0;
+            if (buffer[end-1] == '\n') {
                 offset = 0;
             }
             // // offset = 0;
 
-            set_last_deleted_text(current_state.text.mid(start, end - start - 1 + offset), current_paste_register, true);
+            set_last_deleted_text(buffer.mid(start, end - start - 1 + offset), current_paste_register, true);
             if (cmd !=  VimLineEditCommand::Yank) {
                 remove_text(start, end - start);
             }
@@ -1471,15 +2967,15 @@ void VimEditor::handle_command(VimLineEditCommand cmd, std::optional<char> symbo
 
         if (action_waiting_for_motion->kind == ActionWaitingForMotionKind::Delete || action_waiting_for_motion->kind == ActionWaitingForMotionKind::Yank) {
             set_mode(VimMode::Normal);
-            adapter->set_extra_selections({});
+            adapter->set_extra_selection_layer(VISUAL_SELECTION_LAYER, {});
         }
 
         action_waiting_for_motion = {};
 
     }
 
-    if (cmd != VimLineEditCommand::EnterNormalMode && current_mode == VimMode::Normal && new_pos == current_state.text.size()) {
-        new_pos = current_state.text.size() - 1;
+    if (cmd != VimLineEditCommand::EnterNormalMode && current_mode == VimMode::Normal && new_pos == old_text_size) {
+        new_pos = old_text_size - 1;
     }
 
     if (new_pos != -1) {
@@ -1506,20 +3002,20 @@ int VimEditor::calculate_find(FindState find_state, bool reverse) const {
         reverse ? (find_state.direction == FindDirection::Forward ? FindDirection::Backward
                                                                   : FindDirection::Forward)
                 : find_state.direction;
-    QString text = adapter->get_text();
+    const TextBuffer &text = buffer;
     switch (direction) {
     case FindDirection::Forward:
-        location = text.indexOf(QChar(find_state.character.value_or(' ')),
+        location = text.index_of(QChar(find_state.character.value_or(' ')),
                                          get_cursor_position() + 2);
         break;
     case FindDirection::Backward:
         if (get_cursor_position() == 0)
             return get_cursor_position();
-        location = text.lastIndexOf(QChar(find_state.character.value_or(' ')),
+        location = text.last_index_of(QChar(find_state.character.value_or(' ')),
                                              get_cursor_position() - 1);
         break;
     case FindDirection::ForwardTo:
-        location = text.indexOf(QChar(find_state.character.value_or(' ')),
+        location = text.index_of(QChar(find_state.character.value_or(' ')),
                                          get_cursor_position() + 2);
         if (location != -1) {
             location--;
@@ -1528,7 +3024,7 @@ int VimEditor::calculate_find(FindState find_state, bool reverse) const {
     case FindDirection::BackwardTo:
         if (get_cursor_position() == 0)
             return get_cursor_position();
-        location = text.lastIndexOf(QChar(find_state.character.value_or(' ')),
+        location = text.last_index_of(QChar(find_state.character.value_or(' ')),
                                              get_cursor_position() - 1);
         if (location != -1) {
             location++;
@@ -1544,7 +3040,7 @@ int VimEditor::calculate_find(FindState find_state, bool reverse) const {
 
 int VimEditor::calculate_move_word_forward(bool with_symbols) const {
     int pos = get_cursor_position();
-    const QString t = adapter->get_text();
+    const TextBuffer &t = buffer;
     int len = t.length();
 
     if (pos >= len - 1) {
@@ -1553,149 +3049,811 @@ int VimEditor::calculate_move_word_forward(bool with_symbols) const {
 
     int next_pos = pos;
 
-    if (!t[next_pos].isSpace()) {
+    if (!word_classifier.is_space(t[next_pos])) {
         if (with_symbols) {
-            while (next_pos < len && !t[next_pos].isSpace()) {
+            while (next_pos < len && !word_classifier.is_space(t[next_pos])) {
+                next_pos++;
+            }
+        }
+        else {
+            CharClass word_class = word_classifier.get_class(t[next_pos]);
+            while (next_pos < len && word_classifier.get_class(t[next_pos]) == word_class) {
                 next_pos++;
             }
         }
-        else {
-            bool is_letter = t[next_pos].isLetterOrNumber();
-            while (next_pos < len && !t[next_pos].isSpace() &&
-                   t[next_pos].isLetterOrNumber() == is_letter) {
-                next_pos++;
-            }
+    }
+
+    while (next_pos < len && word_classifier.is_space(t[next_pos])) {
+        next_pos++;
+    }
+
+    if (next_pos < len) {
+        return next_pos;
+    }
+    return pos;
+}
+
+int VimEditor::calculate_move_to_end_of_word(bool with_symbols) const {
+    int pos = get_cursor_position();
+    const TextBuffer &t = buffer;
+    int len = t.length();
+
+    if (pos >= len - 1) {
+        return len - 1;
+    }
+
+    int next_pos = pos;
+
+    // If we're at a space, move to the next non-space character
+    if (word_classifier.is_space(t[next_pos])) {
+        while (next_pos < len && word_classifier.is_space(t[next_pos])) {
+            next_pos++;
+        }
+    }
+    // If we're at the end of a word (next character is space or end), move to next word
+    else if (next_pos + 1 < len && word_classifier.is_space(t[next_pos + 1])) {
+        next_pos++;
+        while (next_pos < len && word_classifier.is_space(t[next_pos])) {
+            next_pos++;
+        }
+    }
+    // If we're in the middle of a word, move to the end of current word
+    else {
+        next_pos++;
+    }
+
+    if (next_pos >= len) {
+        return len - 1;
+    }
+
+    // Now move to the end of the current word
+    if (with_symbols) {
+        while (next_pos < len - 1 && !word_classifier.is_space(t[next_pos + 1])) {
+            next_pos++;
+        }
+    }
+    else {
+        CharClass word_class = word_classifier.get_class(t[next_pos]);
+        while (next_pos < len - 1 && word_classifier.get_class(t[next_pos + 1]) == word_class) {
+            next_pos++;
+        }
+    }
+
+    return next_pos;
+}
+
+int VimEditor::calculate_move_word_backward(bool with_symbols) const {
+    int pos = get_cursor_position();
+    const TextBuffer &t = buffer;
+
+    if (pos <= 0) {
+        return pos;
+    }
+
+    int prev_pos = pos - 1;
+
+    while (prev_pos > 0 && word_classifier.is_space(t[prev_pos])) {
+        prev_pos--;
+    }
+
+    if (with_symbols) {
+        while (prev_pos > 0 && !word_classifier.is_space(t[prev_pos - 1])) {
+            prev_pos--;
+        }
+    }
+    else {
+        CharClass word_class = word_classifier.get_class(t[prev_pos]);
+        while (prev_pos > 0 && word_classifier.get_class(t[prev_pos - 1]) == word_class) {
+            prev_pos--;
+        }
+    }
+
+    return prev_pos;
+}
+
+void VimEditor::delete_char(bool is_single) {
+    int current_pos = get_cursor_position();
+    const TextBuffer &current_text = buffer;
+    if (current_pos <= current_text.length()) {
+        if (current_pos == current_text.length() || current_text[current_pos] == '\n') {
+            if (!is_single){
+                // if the character is a newline, we should not delete it when executing a command with num_repeats
+                return;
+            }
+            else{
+                // otherwise, try to delete the previous character
+                if (current_pos > 0 && current_text[current_pos - 1] != '\n') {
+                    current_pos--;
+                }
+
+            }
+        }
+
+        set_last_deleted_text(current_text.mid(current_pos, 1), current_paste_register);
+        remove_text(current_pos, 1);
+        set_cursor_position(current_pos);
+    }
+}
+
+static qsizetype get_delta_memory_usage(const EditDelta &delta) {
+    return sizeof(EditDelta) + (delta.removed_text.size() + delta.inserted_text.size()) * sizeof(QChar) +
+           delta.removed_marks.size() * sizeof(Mark);
+}
+
+void VimEditor::push_history(HistoryState state) {
+    if (history.current_index < static_cast<int>(history.states.size()) - 1) {
+        // If we are in the middle of the history, remove all states after the current index
+        for (int i = history.current_index + 1; i < history.states.size(); i++) {
+            history.memory_usage -= history.states[i].memory_usage;
+        }
+        history.states.erase(history.states.begin() + history.current_index + 1,
+                             history.states.end());
+    }
+
+    state.memory_usage = sizeof(HistoryState);
+    for (const EditDelta &delta : state.deltas) {
+        state.memory_usage += get_delta_memory_usage(delta);
+    }
+    history.memory_usage += state.memory_usage;
+    history.states.push_back(std::move(state));
+    history.current_index = history.states.size() - 1;
+
+    enforce_undo_memory_budget();
+}
+
+void VimEditor::add_delta_to_history(EditDelta delta) {
+    if (history.current_index < static_cast<int>(history.states.size()) - 1) {
+        // the text no longer matches the states that could be redone
+        for (int i = history.current_index + 1; i < history.states.size(); i++) {
+            history.memory_usage -= history.states[i].memory_usage;
+        }
+        history.states.erase(history.states.begin() + history.current_index + 1,
+                             history.states.end());
+    }
+
+    // edits made before the first undoable command can not be undone
+    if (history.current_index < 0) {
+        return;
+    }
+
+    HistoryState &state = history.states[history.current_index];
+    qsizetype old_usage = state.memory_usage;
+
+    EditDelta *last_delta = state.deltas.size() > 0 ? &state.deltas.back() : nullptr;
+    bool can_merge = last_delta != nullptr && last_delta->removed_text.size() == 0 &&
+                     last_delta->removed_marks.size() == 0 && delta.removed_marks.size() == 0;
+    int last_delta_end = can_merge ? last_delta->position + last_delta->inserted_text.size() : -1;
+
+    if (can_merge && delta.removed_text.size() == 0 && delta.position == last_delta_end) {
+        // typing in insert mode, append to the previous insertion
+        state.memory_usage -= get_delta_memory_usage(*last_delta);
+        last_delta->inserted_text += delta.inserted_text;
+        state.memory_usage += get_delta_memory_usage(*last_delta);
+    }
+    else if (can_merge && delta.inserted_text.size() == 0 && delta.position >= last_delta->position &&
+             delta.position + delta.removed_text.size() == last_delta_end) {
+        // backspace over text that was just inserted
+        state.memory_usage -= get_delta_memory_usage(*last_delta);
+        last_delta->inserted_text.chop(delta.removed_text.size());
+        state.memory_usage += get_delta_memory_usage(*last_delta);
+    }
+    else {
+        state.memory_usage += get_delta_memory_usage(delta);
+        state.deltas.push_back(std::move(delta));
+    }
+
+    history.memory_usage += state.memory_usage - old_usage;
+    enforce_undo_memory_budget();
+}
+
+void VimEditor::enforce_undo_memory_budget() {
+    // the states of a batch are merged when it is closed, so their indices must not change until then
+    if (batch_depth > 0) return;
+
+    // we always keep the state that is currently being recorded, even if it alone exceeds the budget
+    while (history.memory_usage > history.memory_budget && history.current_index > 0) {
+        history.memory_usage -= history.states.front().memory_usage;
+        history.states.pop_front();
+        history.current_index--;
+    }
+}
+
+void VimEditor::set_undo_memory_budget(qsizetype budget_in_bytes) {
+    history.memory_budget = budget_in_bytes;
+    enforce_undo_memory_budget();
+}
+
+qsizetype VimEditor::get_undo_memory_budget() const {
+    return history.memory_budget;
+}
+
+bool VimEditor::set_iskeyword(const QString &option) {
+    return word_classifier.set_iskeyword(option);
+}
+
+QString VimEditor::get_iskeyword() const {
+    return word_classifier.get_iskeyword();
+}
+
+// forwards everything to another adapter and adds the time spent in it to `elapsed_ns`, it is
+// only used while the metrics are enabled
+class TimedTextAdapter : public TextInputAdapter {
+    TextInputAdapter *inner;
+    qint64 *elapsed_ns;
+    // adapter calls can end up in other adapter calls (e.g. through text_changed_callback), only the
+    // outermost one is measured
+    int depth = 0;
+
+    template <typename Function>
+    auto timed(Function function) {
+        struct Scope {
+            TimedTextAdapter *self;
+            QElapsedTimer timer;
+            Scope(TimedTextAdapter *self) : self(self) {
+                if (self->depth++ == 0) timer.start();
+            }
+            ~Scope() {
+                if (--self->depth == 0) *self->elapsed_ns += timer.nsecsElapsed();
+            }
+        } scope(this);
+        return function();
+    }
+
+  public:
+    TimedTextAdapter(TextInputAdapter *inner, qint64 *elapsed_ns) : inner(inner), elapsed_ns(elapsed_ns) {}
+
+    QString get_text() const override {
+        return const_cast<TimedTextAdapter*>(this)->timed([&]() { return inner->get_text(); });
+    }
+    void set_text(QString text) override {
+        timed([&]() { inner->set_text(text); });
+    }
+    void replace_range(int begin, int end, const QString &text) override {
+        timed([&]() { inner->replace_range(begin, end, text); });
+    }
+    void set_cursor_width(int width) override {
+        timed([&]() { inner->set_cursor_width(width); });
+    }
+    void set_extra_selections(const QList<QTextEdit::ExtraSelection> &selections) override {
+        timed([&]() { inner->set_extra_selections(selections); });
+    }
+    QList<QTextEdit::ExtraSelection> get_extra_selections() const override {
+        return const_cast<TimedTextAdapter*>(this)->timed([&]() { return inner->get_extra_selections(); });
+    }
+    void set_extra_selection_layer(int layer, const QList<QTextEdit::ExtraSelection> &selections) override {
+        timed([&]() { inner->set_extra_selection_layer(layer, selections); });
+    }
+    QList<QTextEdit::ExtraSelection> get_extra_selection_layer(int layer) const override {
+        return const_cast<TimedTextAdapter*>(this)->timed([&]() { return inner->get_extra_selection_layer(layer); });
+    }
+    QString get_current_selection(int &begin, int &end) const override {
+        return const_cast<TimedTextAdapter*>(this)->timed([&]() { return inner->get_current_selection(begin, end); });
+    }
+    int get_cursor_position() const override {
+        return const_cast<TimedTextAdapter*>(this)->timed([&]() { return inner->get_cursor_position(); });
+    }
+    void set_cursor_position(int pos) override {
+        timed([&]() { inner->set_cursor_position(pos); });
+    }
+    void set_visual_selection(int begin, int length) override {
+        timed([&]() { inner->set_visual_selection(begin, length); });
+    }
+    void set_cursor_position_with_selection(int pos, int anchor) override {
+        timed([&]() { inner->set_cursor_position_with_selection(pos, anchor); });
+    }
+    QTextDocument *get_document() override {
+        return timed([&]() { return inner->get_document(); });
+    }
+    void set_focus() override {
+        timed([&]() { inner->set_focus(); });
+    }
+    QFontMetrics get_font_metrics() override {
+        return timed([&]() { return inner->get_font_metrics(); });
+    }
+    void key_press_event(QKeyEvent *kevent) override {
+        timed([&]() { inner->key_press_event(kevent); });
+    }
+};
+
+// where `position` ends up when [begin, end) of the text is replaced by `inserted_length` characters. this
+// is what QTextDocument does to its cursors, so the adapters without a widget move their cursor and
+// selection the same way
+static int get_position_after_edit(int position, int begin, int end, int inserted_length) {
+    if (position < begin) {
+        return position;
+    }
+    if (position >= end) {
+        return position + inserted_length - (end - begin);
+    }
+    return begin + inserted_length;
+}
+
+// what a key which VimEditor passes to the widget (mostly typing in insert mode) does to the text, so that
+// the adapters without a widget can apply it themselves
+struct KeyAction {
+    enum Kind {
+        // e.g. shift, or backspace at the beginning of the text
+        Ignore,
+        // [begin, end) is replaced by `text`
+        Edit,
+        // the cursor moves to `position`
+        Move,
+        // only the widget knows what the key does (e.g. up or ctrl+left)
+        Unsupported,
+    };
+    Kind kind = Ignore;
+    int begin = 0;
+    int end = 0;
+    QString text;
+    int position = 0;
+};
+
+static KeyAction get_key_action(QKeyEvent *kevent, int cursor_position, int selection_begin, int selection_end, int text_size,
+                                const std::function<int(int)> &get_line_start, const std::function<int(int)> &get_line_end) {
+    int key = kevent->key();
+    Qt::KeyboardModifiers modifiers = kevent->modifiers() & ~Qt::KeypadModifier;
+    bool has_selection = selection_begin != -1 && selection_begin < selection_end;
+    int edit_begin = has_selection ? selection_begin : cursor_position;
+    int edit_end = has_selection ? selection_end : cursor_position;
+
+    auto edit = [&](int begin, int end, const QString &text) {
+        KeyAction action;
+        action.kind = KeyAction::Edit;
+        action.begin = begin;
+        action.end = end;
+        action.text = text;
+        return action;
+    };
+    auto move = [&](int position) {
+        KeyAction action;
+        action.kind = KeyAction::Move;
+        action.position = position;
+        return action;
+    };
+
+    if (key == Qt::Key_Shift || key == Qt::Key_Control || key == Qt::Key_Meta || key == Qt::Key_Alt ||
+        key == Qt::Key_AltGr || key == Qt::Key_CapsLock) {
+        return KeyAction();
+    }
+
+    // with modifiers, these keys select text, move by words, etc.
+    bool is_editing_key = key == Qt::Key_Backspace || key == Qt::Key_Delete || key == Qt::Key_Return || key == Qt::Key_Enter ||
+                          key == Qt::Key_Left || key == Qt::Key_Right || key == Qt::Key_Home || key == Qt::Key_End;
+    if (is_editing_key && modifiers != Qt::KeyboardModifiers()) {
+        return KeyAction{KeyAction::Unsupported};
+    }
+
+    if (key == Qt::Key_Backspace || key == Qt::Key_Delete) {
+        if (has_selection) {
+            return edit(selection_begin, selection_end, "");
+        }
+        if (key == Qt::Key_Backspace && cursor_position > 0) {
+            return edit(cursor_position - 1, cursor_position, "");
+        }
+        if (key == Qt::Key_Delete && cursor_position < text_size) {
+            return edit(cursor_position, cursor_position + 1, "");
+        }
+        return KeyAction();
+    }
+    if (key == Qt::Key_Return || key == Qt::Key_Enter) {
+        return edit(edit_begin, edit_end, "\n");
+    }
+    if (key == Qt::Key_Left) {
+        return move(cursor_position - 1);
+    }
+    if (key == Qt::Key_Right) {
+        return move(cursor_position + 1);
+    }
+    if (key == Qt::Key_Home) {
+        return move(get_line_start(cursor_position));
+    }
+    if (key == Qt::Key_End) {
+        return move(get_line_end(cursor_position));
+    }
+
+    bool has_shortcut_modifier = modifiers.testFlag(Qt::ControlModifier) || modifiers.testFlag(Qt::MetaModifier) ||
+                                 modifiers.testFlag(Qt::AltModifier);
+    QString event_text = kevent->text();
+    if (!has_shortcut_modifier && event_text.size() > 0 && (event_text[0].isPrint() || event_text[0] == '\t')) {
+        return edit(edit_begin, edit_end, event_text);
+    }
+    return KeyAction{KeyAction::Unsupported};
+}
+
+// adapter which is used while a batch is open. VimEditor applies every edit to its buffer before it
+// tells the adapter about it, so this adapter reads the text from the buffer and only remembers which
+// range of the widget's text has to be replaced when the batch is closed.
+class BatchTextAdapter : public TextInputAdapter {
+    const TextBuffer &buffer;
+    // the adapter of the widget, the layers which are not changed in the batch are read from it
+    const TextInputAdapter *widget_adapter;
+    int cursor_position = 0;
+    int selection_begin = -1;
+    int selection_end = -1;
+    QList<QTextEdit::ExtraSelection> extra_selections;
+
+    void edit_text(int begin, int end, const QString &new_text) {
+        // edits made by the "widget" itself (e.g. typing in insert mode), the callback updates the buffer
+        if (text_changed_callback) {
+            text_changed_callback(begin, end - begin, new_text);
+        }
+        add_changed_range(begin, end - begin, new_text.size());
+        cursor_position = begin + new_text.size();
+        selection_begin = selection_end = -1;
+    }
+
+  public:
+    // [changed_begin, changed_old_end) of the widget's text has to be replaced by
+    // [changed_begin, changed_new_end) of the buffer, -1 if nothing has changed
+    int changed_begin = -1;
+    int changed_old_end = -1;
+    int changed_new_end = -1;
+    bool extra_selections_changed = false;
+    // the selection layers which are set in the batch, only these are passed to the widget's adapter
+    std::map<int, QList<QTextEdit::ExtraSelection>> changed_selection_layers;
+
+    BatchTextAdapter(const TextBuffer &buffer, const TextInputAdapter *widget_adapter) : buffer(buffer), widget_adapter(widget_adapter) {}
+
+    void add_changed_range(int position, int chars_removed, int chars_inserted) {
+        if (changed_begin == -1) {
+            changed_begin = position;
+            changed_old_end = position + chars_removed;
+            changed_new_end = position + chars_inserted;
+            return;
+        }
+
+        // the text around the changed range is the same in the widget and in the buffer
+        changed_begin = std::min(changed_begin, position);
+        if (position + chars_removed > changed_new_end) {
+            changed_old_end += position + chars_removed - changed_new_end;
+            changed_new_end = position + chars_removed;
+        }
+        changed_new_end += chars_inserted - chars_removed;
+    }
+
+    void set_initial_extra_selections(const QList<QTextEdit::ExtraSelection> &selections) {
+        extra_selections = selections;
+    }
+
+    QString get_text() const override {
+        return buffer.to_string();
+    }
+    void set_text(QString text) override {
+        edit_text(0, buffer.size(), text);
+    }
+    void replace_range(int begin, int end, const QString &text) override {
+        add_changed_range(begin, end - begin, text.size());
+        cursor_position = get_position_after_edit(cursor_position, begin, end, text.size());
+        if (selection_begin != -1) {
+            selection_begin = get_position_after_edit(selection_begin, begin, end, text.size());
+            selection_end = get_position_after_edit(selection_end, begin, end, text.size());
+            if (selection_begin >= selection_end) {
+                selection_begin = selection_end = -1;
+            }
+        }
+    }
+    void set_cursor_width(int width) override {
+    }
+    void set_extra_selections(const QList<QTextEdit::ExtraSelection> &selections) override {
+        extra_selections = selections;
+        extra_selections_changed = true;
+        if (selections.size() == 0) {
+            selection_begin = selection_end = -1;
+        }
+    }
+    QList<QTextEdit::ExtraSelection> get_extra_selections() const override {
+        return extra_selections;
+    }
+    void set_extra_selection_layer(int layer, const QList<QTextEdit::ExtraSelection> &selections) override {
+        changed_selection_layers[layer] = selections;
+        if (layer == VISUAL_SELECTION_LAYER && selections.isEmpty()) {
+            selection_begin = selection_end = -1;
+        }
+    }
+    QList<QTextEdit::ExtraSelection> get_extra_selection_layer(int layer) const override {
+        auto selections = changed_selection_layers.find(layer);
+        if (selections == changed_selection_layers.end()) {
+            return widget_adapter->get_extra_selection_layer(layer);
+        }
+        return selections->second;
+    }
+    QString get_current_selection(int &begin, int &end) const override {
+        if (selection_begin == -1) {
+            begin = end = cursor_position;
+            return "";
+        }
+        begin = selection_begin;
+        end = selection_end;
+        return buffer.mid(begin, end - begin);
+    }
+    int get_cursor_position() const override {
+        return cursor_position;
+    }
+    void set_cursor_position(int pos) override {
+        cursor_position = std::clamp(pos, 0, buffer.size());
+    }
+    void set_visual_selection(int begin, int length) override {
+        selection_begin = std::clamp(begin, 0, buffer.size());
+        selection_end = std::clamp(begin + length, selection_begin, buffer.size());
+    }
+    void set_cursor_position_with_selection(int pos, int anchor) override {
+        int selection_min = std::min<int>(anchor, pos);
+        int selection_max = std::max<int>(anchor, pos);
+        set_visual_selection(selection_min, selection_max - selection_min + 1);
+        set_cursor_position(pos);
+    }
+    QTextDocument *get_document() override {
+        return nullptr;
+    }
+    void set_focus() override {
+    }
+    QFontMetrics get_font_metrics() override {
+        return QFontMetrics(QFont());
+    }
+    KeyAction get_key_action(QKeyEvent *kevent) const {
+        return QVimEditor::get_key_action(kevent, cursor_position, selection_begin, selection_end, buffer.size(),
+                              [&](int position) { return buffer.line_start_position(position); },
+                              [&](int position) { return buffer.line_end_position(position); });
+    }
+    // false for the keys which only the widget can handle, VimEditor gives them to the widget instead
+    bool can_handle_key(QKeyEvent *kevent) const {
+        return get_key_action(kevent).kind != KeyAction::Unsupported;
+    }
+    void key_press_event(QKeyEvent *kevent) override {
+        KeyAction action = get_key_action(kevent);
+        if (action.kind == KeyAction::Edit) {
+            edit_text(action.begin, action.end, action.text);
+        }
+        else if (action.kind == KeyAction::Move) {
+            set_cursor_position(action.position);
         }
     }
+};
 
-    while (next_pos < len && t[next_pos].isSpace()) {
-        next_pos++;
-    }
+void CommandMetrics::add_sample(qint64 elapsed_ns, qint64 adapter_elapsed_ns, int buffer_size) {
+    count++;
+    total_ns += elapsed_ns;
+    max_ns = std::max(max_ns, elapsed_ns);
+    adapter_ns += adapter_elapsed_ns;
+    total_buffer_size += buffer_size;
+    max_buffer_size = std::max(max_buffer_size, buffer_size);
+
+    int bucket = 0;
+    qint64 elapsed_us = elapsed_ns / 1000;
+    while (elapsed_us > 0 && bucket < HISTOGRAM_BUCKETS - 1) {
+        elapsed_us >>= 1;
+        bucket++;
+    }
+    latency_histogram[bucket]++;
+}
 
-    if (next_pos < len) {
-        return next_pos;
-    }
-    return pos;
+double CommandMetrics::get_mean_us() const {
+    return count > 0 ? total_ns / 1000.0 / count : 0;
 }
 
-int VimEditor::calculate_move_to_end_of_word(bool with_symbols) const {
-    int pos = get_cursor_position();
-    const QString t = adapter->get_text();
-    int len = t.length();
+double CommandMetrics::get_percentile_us(double percentile) const {
+    if (count == 0) return 0;
 
-    if (pos >= len - 1) {
-        return len - 1;
+    qint64 target = std::max<qint64>(1, std::ceil(count * percentile / 100.0));
+    qint64 seen = 0;
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS - 1; bucket++) {
+        seen += latency_histogram[bucket];
+        if (seen >= target) {
+            return std::min<double>(1 << bucket, max_ns / 1000.0);
+        }
     }
+    return max_ns / 1000.0;
+}
 
-    int next_pos = pos;
+bool VimEditor::set_metrics_enabled(bool enabled) {
+    if (enabled == get_metrics_enabled()) return true;
+    // end_batch restores the adapter which was used before the batch, so the adapters can't be
+    // swapped until then
+    if (batch_depth > 0) return false;
 
-    // If we're at a space, move to the next non-space character
-    if (t[next_pos].isSpace()) {
-        while (next_pos < len && t[next_pos].isSpace()) {
-            next_pos++;
-        }
-    }
-    // If we're at the end of a word (next character is space or end), move to next word
-    else if (next_pos + 1 < len && t[next_pos + 1].isSpace()) {
-        next_pos++;
-        while (next_pos < len && t[next_pos].isSpace()) {
-            next_pos++;
-        }
+    if (enabled) {
+        metrics = std::make_unique<EditorMetrics>();
+        untimed_adapter = adapter;
+        timed_adapter = std::make_unique<TimedTextAdapter>(adapter, &metrics->adapter_ns);
+        adapter = timed_adapter.get();
     }
-    // If we're in the middle of a word, move to the end of current word
     else {
-        next_pos++;
+        adapter = untimed_adapter;
+        untimed_adapter = nullptr;
+        timed_adapter = nullptr;
+        metrics = nullptr;
     }
+    return true;
+}
 
-    if (next_pos >= len) {
-        return len - 1;
-    }
+bool VimEditor::get_metrics_enabled() const {
+    return metrics != nullptr;
+}
 
-    // Now move to the end of the current word
-    if (with_symbols) {
-        while (next_pos < len - 1 && !t[next_pos + 1].isSpace()) {
-            next_pos++;
-        }
-    }
-    else {
-        bool is_letter = t[next_pos].isLetterOrNumber();
-        while (next_pos < len - 1 && !t[next_pos + 1].isSpace() &&
-               t[next_pos + 1].isLetterOrNumber() == is_letter) {
-            next_pos++;
-        }
+const EditorMetrics *VimEditor::get_metrics() const {
+    return metrics.get();
+}
+
+void VimEditor::reset_metrics() {
+    if (metrics) {
+        // the timed adapter keeps a pointer to adapter_ns, so we reset the object in place
+        *metrics = EditorMetrics();
     }
+}
 
-    return next_pos;
+TextInputAdapter *VimEditor::get_untimed_adapter() const {
+    if (batch_adapter) return batch_adapter.get();
+    return untimed_adapter ? untimed_adapter : adapter;
 }
 
-int VimEditor::calculate_move_word_backward(bool with_symbols) const {
-    int pos = get_cursor_position();
-    const QString t = adapter->get_text();
+static QJsonObject command_metrics_to_json(const CommandMetrics &command_metrics) {
+    QJsonObject object;
+    object.insert("count", command_metrics.count);
+    object.insert("mean_us", command_metrics.get_mean_us());
+    object.insert("p50_us", command_metrics.get_percentile_us(50));
+    object.insert("p99_us", command_metrics.get_percentile_us(99));
+    object.insert("max_us", command_metrics.max_ns / 1000.0);
+    object.insert("adapter_us", command_metrics.adapter_ns / 1000.0);
+    object.insert("mean_buffer_size", command_metrics.count > 0 ? (double)command_metrics.total_buffer_size / command_metrics.count : 0);
+    object.insert("max_buffer_size", command_metrics.max_buffer_size);
+
+    QJsonArray histogram;
+    for (int bucket_count : command_metrics.latency_histogram) {
+        histogram.append(bucket_count);
+    }
+    object.insert("latency_histogram", histogram);
+    return object;
+}
 
-    if (pos <= 0) {
-        return pos;
+QByteArray VimEditor::get_metrics_json() const {
+    QJsonObject root;
+    root.insert("enabled", metrics != nullptr);
+    if (metrics) {
+        root.insert("adapter_us", metrics->adapter_ns / 1000.0);
+        root.insert("key_presses", command_metrics_to_json(metrics->key_presses));
+
+        QJsonObject commands;
+        for (const auto& [cmd, command_metrics] : metrics->commands) {
+            commands.insert(to_string(cmd), command_metrics_to_json(command_metrics));
+        }
+        root.insert("commands", commands);
     }
+    return QJsonDocument(root).toJson();
+}
 
-    int prev_pos = pos - 1;
+bool VimEditor::apply_history_delta(const EditDelta &delta, bool reverse) {
+    const QString &old_text = reverse ? delta.inserted_text : delta.removed_text;
+    const QString &new_text = reverse ? delta.removed_text : delta.inserted_text;
 
-    while (prev_pos > 0 && t[prev_pos].isSpace()) {
-        prev_pos--;
+    if (buffer.mid(delta.position, old_text.size()) != old_text) {
+        // the text was changed in a way that we didn't record, so the history can not be applied
+        history = History{{}, -1, 0, history.memory_budget};
+        return false;
     }
 
-    if (with_symbols) {
-        while (prev_pos > 0 && !t[prev_pos - 1].isSpace()) {
-            prev_pos--;
-        }
-    }
-    else {
-        bool is_letter = t[prev_pos].isLetterOrNumber();
-        while (prev_pos > 0 && !t[prev_pos - 1].isSpace() &&
-               t[prev_pos - 1].isLetterOrNumber() == is_letter) {
-            prev_pos--;
+    update_marks_for_edit(delta.position, delta.position + old_text.size(), new_text.size());
+    if (reverse) {
+        for (const Mark &mark : delta.removed_marks) {
+            marks.set(mark.name, mark.position);
         }
     }
 
-    return prev_pos;
+    replace_buffer_text(delta.position, old_text.size(), new_text);
+    is_applying_edit = true;
+    adapter->replace_range(delta.position, delta.position + old_text.size(), new_text);
+    is_applying_edit = false;
+    return true;
 }
 
-void VimEditor::delete_char(bool is_single) {
-    int current_pos = get_cursor_position();
-    QString current_text = adapter->get_text();
-    if (current_pos <= current_text.length()) {
-        if (current_pos == current_text.length() || current_text[current_pos] == '\n') {
-            if (!is_single){
-                // if the character is a newline, we should not delete it when executing a command with num_repeats
-                return;
-            }
-            else{
-                // otherwise, try to delete the previous character
-                if (current_pos > 0 && current_text[current_pos - 1] != '\n') {
-                    current_pos--;
-                }
+void VimEditor::begin_batch() {
+    if (batch_depth++ > 0) return;
+    batch_first_history_index = history.current_index + 1;
+    open_batch_adapter();
+}
 
-            }
+void VimEditor::end_batch() {
+    if (--batch_depth > 0) return;
+    close_batch_adapter();
+    merge_batch_history();
+}
+
+void VimEditor::open_batch_adapter() {
+    // line edits handle some keys (e.g. return) differently and their text is short anyway. the
+    // visual selections of text edits are kept in the widget, so we don't batch them either.
+    if (dynamic_cast<QLineEdit*>(editor_widget)) return;
+    if (editor_widget && (current_mode == VimMode::Visual || current_mode == VimMode::VisualLine)) return;
+
+    auto new_batch_adapter = std::make_unique<BatchTextAdapter>(buffer, adapter);
+    int selection_begin, selection_end;
+    adapter->get_current_selection(selection_begin, selection_end);
+    if (selection_end > selection_begin) {
+        new_batch_adapter->set_visual_selection(selection_begin, selection_end - selection_begin);
+    }
+    new_batch_adapter->set_cursor_position(adapter->get_cursor_position());
+    new_batch_adapter->set_initial_extra_selections(adapter->get_extra_selections());
+    new_batch_adapter->text_changed_callback = [this](int position, int chars_removed, const QString &inserted_text) {
+        handle_adapter_text_change(position, chars_removed, inserted_text);
+    };
+
+    adapter_before_batch = adapter;
+    batch_adapter = std::move(new_batch_adapter);
+    adapter = batch_adapter.get();
+}
+
+void VimEditor::close_batch_adapter() {
+    if (batch_adapter) {
+        BatchTextAdapter *batch = static_cast<BatchTextAdapter*>(batch_adapter.get());
+        adapter = adapter_before_batch;
+        adapter_before_batch = nullptr;
+
+        if (batch->changed_begin != -1) {
+            is_applying_edit = true;
+            adapter->replace_range(batch->changed_begin, batch->changed_old_end,
+                                   buffer.mid(batch->changed_begin, batch->changed_new_end - batch->changed_begin));
+            is_applying_edit = false;
+        }
+        if (batch->extra_selections_changed) {
+            adapter->set_extra_selections(batch->get_extra_selections());
+        }
+        // the adapter skips the layers which end up the same as before the batch
+        for (const auto &[layer, selections] : batch->changed_selection_layers) {
+            adapter->set_extra_selection_layer(layer, selections);
         }
 
-        set_last_deleted_text(current_text.mid(current_pos, 1), current_paste_register);
-        remove_text(current_pos, 1);
-        set_cursor_position(current_pos);
+        int selection_begin, selection_end;
+        batch->get_current_selection(selection_begin, selection_end);
+        if (selection_end > selection_begin) {
+            adapter->set_visual_selection(selection_begin, selection_end - selection_begin);
+        }
+        adapter->set_cursor_position(batch->get_cursor_position());
+        batch_adapter = nullptr;
+        set_style_for_mode(current_mode);
     }
 }
 
-void VimEditor::push_history(HistoryState state) {
-    if (history.current_index >= 0 && history.current_index < history.states.size() - 1) {
-        // If we are in the middle of the history, remove all states after the current index
-        history.states.erase(history.states.begin() + history.current_index + 1,
-                             history.states.end());
+void VimEditor::pass_key_to_adapter(QKeyEvent *event) {
+    BatchTextAdapter *batch = static_cast<BatchTextAdapter*>(batch_adapter.get());
+    if (batch && !batch->can_handle_key(event)) {
+        // keys like up or ctrl+left need the widget, so we bring it up to date and let it handle the
+        // key before we continue the batch
+        close_batch_adapter();
+        adapter->key_press_event(event);
+        open_batch_adapter();
+        return;
     }
+    adapter->key_press_event(event);
+}
 
-    history.states.push_back(state);
+void VimEditor::merge_batch_history() {
+    int first_index = batch_first_history_index;
+    batch_first_history_index = -1;
 
-    if (history.states.size() > 100) {
-        history.states.pop_front();
+    // nothing to merge if the batch recorded at most one state (or undid the changes before it)
+    if (first_index < 0 || history.current_index <= first_index) {
+        enforce_undo_memory_budget();
+        return;
     }
 
-    history.current_index = history.states.size() - 1;
+    HistoryState merged_state;
+    merged_state.cursor_position = history.states[first_index].cursor_position;
+    for (int i = first_index; i <= history.current_index; i++) {
+        for (EditDelta &delta : history.states[i].deltas) {
+            merged_state.deltas.push_back(std::move(delta));
+        }
+    }
+
+    for (int i = first_index; i < history.states.size(); i++) {
+        history.memory_usage -= history.states[i].memory_usage;
+    }
+    history.states.erase(history.states.begin() + first_index, history.states.end());
+    history.current_index = first_index - 1;
+
+    if (merged_state.deltas.size() > 0) {
+        push_history(std::move(merged_state));
+    }
+    else {
+        enforce_undo_memory_budget();
+    }
 }
 
 void VimEditor::undo() {
@@ -1704,23 +3862,58 @@ void VimEditor::undo() {
         return;
     }
 
+    const HistoryState &state = history.states[history.current_index];
     history.current_index--;
-    const HistoryState &state = history.states[history.current_index + 1];
-    adapter->set_text(state.text);
-    set_cursor_position(state.cursor_position);
-    marks = state.marks;
+
+    // `state` is destroyed if a delta can't be applied and the history is cleared
+    int cursor_position = state.cursor_position;
+    for (auto it = state.deltas.rbegin(); it != state.deltas.rend(); it++) {
+        if (!apply_history_delta(*it, true)) return;
+    }
+    set_cursor_position(cursor_position);
 }
 
 void VimEditor::redo() {
-    if (history.current_index >= history.states.size() - 1) {
+    if (history.current_index >= static_cast<int>(history.states.size()) - 1) {
         return;
     }
 
     history.current_index++;
     const HistoryState &state = history.states[history.current_index];
-    adapter->set_text(state.text);
-    set_cursor_position(state.cursor_position);
-    marks = state.marks;
+
+    int cursor_position = state.cursor_position;
+    for (const EditDelta &delta : state.deltas) {
+        if (!apply_history_delta(delta, false)) return;
+    }
+    set_cursor_position(cursor_position);
+}
+
+void VimEditor::handle_adapter_text_change(int position, int chars_removed, const QString &inserted_text) {
+    if (is_applying_edit) {
+        return;
+    }
+
+    if (position > buffer.size()) {
+        // we somehow lost track of the widget's text, the recorded history is no longer valid
+        buffer.set_text(adapter->get_text());
+        history = History{{}, -1, 0, history.memory_budget};
+        return;
+    }
+
+    chars_removed = std::min(chars_removed, buffer.size() - position);
+    QString removed_text = buffer.mid(position, chars_removed);
+    if (removed_text == inserted_text) {
+        // e.g. only the formatting of the text has changed
+        return;
+    }
+
+    EditDelta delta;
+    delta.position = position;
+    delta.removed_text = removed_text;
+    delta.inserted_text = inserted_text;
+
+    replace_buffer_text(position, chars_removed, inserted_text);
+    add_delta_to_history(std::move(delta));
 }
 
 bool equal_with_shift(const KeyboardModifierState &lhs, const KeyboardModifierState &rhs) {
@@ -1751,34 +3944,30 @@ KeyboardModifierState KeyboardModifierState::from_qt_modifiers(Qt::KeyboardModif
 QString VimEditor::get_word_under_cursor_bounds(int &start, int &end){
     // Handle surrounding word action
     int cursor_pos = get_cursor_position();
-    QString current_text = adapter->get_text();
+    const TextBuffer &current_text = buffer;
 
     // If cursor is not on a word character, don't do anything
-    if (cursor_pos >= current_text.length() ||
-        !(current_text[cursor_pos].isLetterOrNumber() || current_text[cursor_pos] == '_')) {
+    if (cursor_pos >= current_text.length() || !word_classifier.is_word(current_text[cursor_pos])) {
         return "";
     }
 
-    // Find word boundaries - only include word characters (letters, numbers,
-    // underscore)
+    // Find word boundaries - only include word characters (see set_iskeyword)
     start = cursor_pos;
     end = cursor_pos;
 
     // Move start backward to beginning of word
-    while (start > 0 &&
-           (current_text[start - 1].isLetterOrNumber() || current_text[start - 1] == '_')) {
+    while (start > 0 && word_classifier.is_word(current_text[start - 1])) {
         start--;
     }
 
     // Move end forward to end of word (start from cursor, move until non-word char)
-    while (end < current_text.length() &&
-           (current_text[end].isLetterOrNumber() || current_text[end] == '_')) {
+    while (end < current_text.length() && word_classifier.is_word(current_text[end])) {
         end++;
     }
 
     // include the following spaces
     if (action_waiting_for_motion->surrounding_scope == SurroundingScope::Around) {
-        while (end < current_text.length() && current_text[end].isSpace()) {
+        while (end < current_text.length() && word_classifier.is_space(current_text[end])) {
             end++;
         }
     }
@@ -1855,43 +4044,56 @@ bool VimEditor::handle_surrounding_motion_action() {
             }
 
             int cursor_pos = get_cursor_position();
-            QString current_text = adapter->get_text();
+            const TextBuffer &current_text = buffer;
             int start = cursor_pos;
             int end = cursor_pos;
             bool found_begin = false;
             bool found_end = false;
-            int begin_to_find = 1;
-            int end_to_find = 1;
-
-            // Find the beginning of the surrounding
-            while (start > 0) {
-                if (current_text[start - 1] == begin_symbol) {
-                    begin_to_find--;
-                    if (begin_to_find == 0) {
-                        found_begin = true;
-                        start--;
-                        break;
-                    }
-                }
-                if (current_text[start - 1] == end_symbol) {
-                    begin_to_find++;
+
+            if (begin_symbol != end_symbol) {
+                int begin_position, end_position;
+                if (find_enclosing_brackets(action_waiting_for_motion->surrounding_kind, cursor_pos, begin_position, end_position)) {
+                    start = begin_position;
+                    end = end_position + 1;
+                    found_begin = true;
+                    found_end = true;
                 }
-                start--;
-            }
-            // Find the end of the surrounding
-            while (end < current_text.length()) {
-                if (current_text[end] == end_symbol) {
-                    end_to_find--;
-                    if (end_to_find == 0) {
-                        found_end = true;
-                        end++;
-                        break;
+            }
+            else {
+                // quotes don't nest, so we use the closest ones around the cursor
+                int begin_to_find = 1;
+                int end_to_find = 1;
+
+                // Find the beginning of the surrounding
+                while (start > 0) {
+                    if (current_text[start - 1] == begin_symbol) {
+                        begin_to_find--;
+                        if (begin_to_find == 0) {
+                            found_begin = true;
+                            start--;
+                            break;
+                        }
                     }
+                    if (current_text[start - 1] == end_symbol) {
+                        begin_to_find++;
+                    }
+                    start--;
                 }
-                if (current_text[end] == begin_symbol) {
-                    end_to_find++;
+                // Find the end of the surrounding
+                while (end < current_text.length()) {
+                    if (current_text[end] == end_symbol) {
+                        end_to_find--;
+                        if (end_to_find == 0) {
+                            found_end = true;
+                            end++;
+                            break;
+                        }
+                    }
+                    if (current_text[end] == begin_symbol) {
+                        end_to_find++;
+                    }
+                    end++;
                 }
-                end++;
             }
 
             if (action_waiting_for_motion->surrounding_scope == SurroundingScope::Inside) {
@@ -1940,96 +4142,75 @@ void VimEditor::set_cursor_position_with_selection(int pos) {
 }
 
 void VimEditor::set_cursor_position_with_line_selection(int pos) {
-    if (!dynamic_cast<QTextEditAdapter*>(adapter)){
+    if (dynamic_cast<QLineEdit*>(editor_widget)){
         return;
     }
-    QTextEditAdapter *text_adapter = static_cast<QTextEditAdapter*>(adapter);
-    QTextCursor cursor = text_adapter->text_edit->textCursor();
-    int current_cursor_pos = get_cursor_position();
-    
-    // Get line boundaries for both anchor and current position
-    int anchor_line_start = get_line_start_position(visual_mode_anchor);
-    int anchor_line_end = get_line_end_position(visual_mode_anchor);
-    int pos_line_start = get_line_start_position(pos);
-    int pos_line_end = get_line_end_position(pos);
-    
-    // Determine selection direction and boundaries
-    int selection_start, selection_end;
-    if (visual_mode_anchor <= pos) {
-        // Forward selection: from start of anchor line to end of current line
-        selection_start = anchor_line_start;
-        selection_end = pos_line_end;
-    } else {
-        // Backward selection: from start of current line to end of anchor line
-        selection_start = pos_line_start;
-        selection_end = anchor_line_end;
-    }
-    
-    // Include the newline character if it exists (except for the last line)
-    const QString &text = adapter->get_text();
-    if (selection_end < text.length() && text[selection_end] == '\n') {
-        selection_end++;
-    }
-    
-    cursor.setPosition(selection_start, QTextCursor::MoveAnchor);
-    cursor.setPosition(selection_end, QTextCursor::KeepAnchor);
+
+    // the selection covers the lines between the anchor and the cursor, including the newline of the last
+    // one (except for the last line of the text). the buffer's newline index gives us the bounds directly.
+    int anchor_line = buffer.line_number(visual_mode_anchor);
+    int pos_line = buffer.line_number(pos);
+    int first_line = std::min(anchor_line, pos_line);
+    int last_line = std::max(anchor_line, pos_line);
+    int selection_start = first_line == 0 ? 0 : buffer.newline_position(first_line - 1) + 1;
+    int selection_end = last_line < buffer.line_count() - 1 ? buffer.newline_position(last_line) + 1 : buffer.size();
+
     visual_line_selection_begin = selection_start;
     visual_line_selection_end = selection_end;
 
+    QTextEditAdapter *text_adapter = dynamic_cast<QTextEditAdapter*>(get_untimed_adapter());
+    if (text_adapter == nullptr) {
+        adapter->set_visual_selection(selection_start, selection_end - selection_start);
+        set_cursor_position(pos);
+        return;
+    }
 
-    QTextEdit::ExtraSelection selection;
-    selection.cursor = cursor;
+    // the selection is created when the visual line mode is entered, after that we only move its endpoints
+    if (visual_line_selection.cursor.document() != text_adapter->text_edit->document()) {
+        visual_line_selection.cursor = QTextCursor(text_adapter->text_edit->document());
 
-    QColor selection_foreground_color = text_adapter->text_edit->palette().color(QPalette::Text);
-    QColor selection_background_color = text_adapter->text_edit->palette().color(QPalette::Highlight);
-    selection.format.setBackground(selection_background_color);
-    selection.format.setForeground(selection_foreground_color);
+        QColor selection_foreground_color = text_adapter->text_edit->palette().color(QPalette::Text);
+        QColor selection_background_color = text_adapter->text_edit->palette().color(QPalette::Highlight);
+        visual_line_selection.format = QTextCharFormat();
+        visual_line_selection.format.setBackground(selection_background_color);
+        visual_line_selection.format.setForeground(selection_foreground_color);
+    }
+    visual_line_selection.cursor.setPosition(selection_start, QTextCursor::MoveAnchor);
+    visual_line_selection.cursor.setPosition(selection_end, QTextCursor::KeepAnchor);
 
-    adapter->set_extra_selections({selection});
+    adapter->set_extra_selection_layer(VISUAL_SELECTION_LAYER, {visual_line_selection});
     set_cursor_position(pos);
 }
 
 int VimEditor::get_line_start_position(int cursor_pos) {
-    const QString text = adapter->get_text();
-    int pos = cursor_pos;
-    pos = std::min<int>(pos, text.size());
-
-    while (pos > 0 && text[pos - 1] != '\n') {
-        pos--;
+    if (cursor_pos <= 0) {
+        return cursor_pos;
     }
-
-    return pos;
+    return buffer.line_start_position(cursor_pos);
 }
 
 int VimEditor::get_ith_line_start_position(int i) {
-    const QString text = adapter->get_text();
-    int line_start = 0;
-    for (int line = 0; line < i && line_start < text.length(); ++line) {
-        line_start = text.indexOf('\n', line_start);
-        if (line_start == -1) {
-            break;
-        }
-        line_start++;
+    if (i <= 0 || buffer.length() == 0) {
+        return 0;
     }
-    return line_start;
+    if (i < buffer.line_count()) {
+        return buffer.newline_position(i - 1) + 1;
+    }
+
+    // past the last line we end up at the end of the text if it ends with a newline
+    int last_line_start = buffer.line_count() > 1 ? buffer.newline_position(buffer.line_count() - 2) + 1 : 0;
+    return last_line_start == buffer.length() ? last_line_start : -1;
 }
 
 
 int VimEditor::get_line_end_position(int cursor_pos) {
-    const QString text = adapter->get_text();
-    int pos = cursor_pos;
-    int length = text.length();
-
-    while (pos < length && text[pos] != '\n') {
-        pos++;
+    if (cursor_pos >= buffer.length()) {
+        return cursor_pos;
     }
-
-    return pos;
+    return buffer.line_end_position(std::max(cursor_pos, 0));
 }
 
 int VimEditor::calculate_move_up(int cursor_pos) {
-    const QString text = adapter->get_text();
-
     int current_line_start = get_line_start_position(cursor_pos);
     int column_offset = cursor_pos - current_line_start;
 
@@ -2067,7 +4248,7 @@ int VimEditor::calculate_move_up(int cursor_pos) {
 }
 
 int VimEditor::calculate_move_down(int cursor_pos) {
-    const QString &text = adapter->get_text();
+    const TextBuffer &text = buffer;
 
     int current_line_start = get_line_start_position(cursor_pos);
     int column_offset = cursor_pos - current_line_start;
@@ -2125,7 +4306,8 @@ int VimEditor::calculate_move_on_screen(int direction) {
     QTextDocument *doc = adapter->get_document();
 
     if (doc == nullptr) {
-        return 0;
+        // without a layout the lines on the screen are the same as the lines of the text
+        return direction > 0 ? calculate_move_down(current_pos) : calculate_move_up(current_pos);
     }
 
     QTextBlock current_block = doc->findBlock(current_pos);
@@ -2198,17 +4380,6 @@ int VimEditor::calculate_move_on_screen(int direction) {
     return target_block.position() + target_line.textStart() + target_index;
 }
 
-InputTreeNode InputTreeNode::clone() const {
-    // create a deep clone
-    InputTreeNode new_node;
-    new_node.key_chord = this->key_chord;
-    new_node.command = this->command;
-    for (const auto& child : this->children) {
-        new_node.children.push_back(child.clone());
-    }
-    return new_node;
-}
-
 // void VimEditor::resizeEvent(QResizeEvent *event) {
 //     // move the command line edit to the bottom
 //     command_line_edit->resize(event->size().width(), command_line_edit->height());
@@ -2225,6 +4396,15 @@ QColor get_darker_color(QColor color){
 }
 
 void VimEditor::show_command_line_edit(QString initial_command_text, QString placeholder_text){
+    if (editor_widget == nullptr) {
+        headless_command_line_text = initial_command_text;
+        return;
+    }
+
+    if (command_line_edit == nullptr) {
+        create_command_line_edit();
+    }
+
     // get editor widget's background color
     QColor background_color = get_darker_color(editor_widget->palette().color(QPalette::Base));
     QColor text_color = editor_widget->palette().color(QPalette::Text);
@@ -2239,6 +4419,15 @@ void VimEditor::show_command_line_edit(QString initial_command_text, QString pla
 }
 
 void VimEditor::hide_command_line_edit(){
+    if (editor_widget == nullptr) {
+        headless_command_line_text = {};
+        return;
+    }
+
+    if (command_line_edit == nullptr) {
+        return;
+    }
+
     command_line_edit->setText("");
     command_line_edit->hide();
     adapter->set_focus();
@@ -2268,35 +4457,217 @@ void VimEditor::perform_pending_text_command_with_text(QString text){
 
 }
 
-void VimEditor::handle_action_waiting_for_motion(int old_pos, int new_pos, int delete_pos_offset){
-    if (action_waiting_for_motion.has_value()) {
-        QString current_text = adapter->get_text();
-        if (action_waiting_for_motion.value().kind == ActionWaitingForMotionKind::Delete ||
-            action_waiting_for_motion.value().kind == ActionWaitingForMotionKind::Change) {
-            // delete from old_pos to new_pos
-            if (old_pos < new_pos) {
-                set_last_deleted_text(
-                    current_text.mid(old_pos, new_pos + delete_pos_offset - old_pos), current_paste_register);
-                remove_text(old_pos, new_pos + delete_pos_offset - old_pos);
-                set_cursor_position(old_pos);
-            }
-            else if (old_pos > new_pos) {
-                set_last_deleted_text(current_text.mid(new_pos, old_pos - new_pos), current_paste_register);
-                remove_text(new_pos, old_pos - new_pos);
-                set_cursor_position(new_pos);
-            }
+void VimEditor::handle_action_waiting_for_motion(int old_pos, int new_pos, int delete_pos_offset){
+    if (action_waiting_for_motion.has_value()) {
+        const TextBuffer &current_text = buffer;
+        if (action_waiting_for_motion.value().kind == ActionWaitingForMotionKind::Delete ||
+            action_waiting_for_motion.value().kind == ActionWaitingForMotionKind::Change) {
+            // delete from old_pos to new_pos
+            if (old_pos < new_pos) {
+                set_last_deleted_text(
+                    current_text.mid(old_pos, new_pos + delete_pos_offset - old_pos), current_paste_register);
+                remove_text(old_pos, new_pos + delete_pos_offset - old_pos);
+                set_cursor_position(old_pos);
+            }
+            else if (old_pos > new_pos) {
+                set_last_deleted_text(current_text.mid(new_pos, old_pos - new_pos), current_paste_register);
+                remove_text(new_pos, old_pos - new_pos);
+                set_cursor_position(new_pos);
+            }
+
+            if (action_waiting_for_motion.value().kind == ActionWaitingForMotionKind::Change) {
+                set_mode(VimMode::Insert);
+            }
+        }
+
+        if (action_waiting_for_motion.value().kind == ActionWaitingForMotionKind::Visual) {
+            set_cursor_position_with_selection(new_pos);
+        }
+
+        action_waiting_for_motion = {};
+    }
+}
+
+// all the positions where `text` (which is lowercase) occurs in `range_text`, including overlapping ones
+static std::vector<int> find_all_matches(const QString &range_text, const QString &text, int range_begin) {
+    std::vector<int> matches;
+    int index = index_of_substring(range_text, text);
+    while (index != -1) {
+        matches.push_back(range_begin + index);
+        index = index_of_substring(range_text, text, index + 1);
+    }
+    return matches;
+}
+
+const std::vector<int> &VimEditor::get_search_matches(const QString &query) {
+    QString text = query.toLower();
+    if (!search_match_index.has_value() ||
+        search_match_index->query != text ||
+        search_match_index->buffer_revision != buffer.get_revision()) {
+
+        SearchMatchIndex index;
+        index.query = text;
+        index.buffer_revision = buffer.get_revision();
+        if (text.size() > 0) {
+            index.match_positions = find_all_matches(buffer.to_string().toLower(), text, 0);
+        }
+        search_match_index = std::move(index);
+    }
+    return search_match_index->match_positions;
+}
+
+static const char BRACKET_PAIRS[4][2] = {{'(', ')'}, {'[', ']'}, {'{', '}'}, {'<', '>'}};
+
+// index of `ch`'s pair in BRACKET_PAIRS or -1 if it is not a bracket
+static int get_bracket_pair_kind(QChar ch, bool &is_opening) {
+    for (int i = 0; i < 4; i++) {
+        if (ch == BRACKET_PAIRS[i][0] || ch == BRACKET_PAIRS[i][1]) {
+            is_opening = ch == BRACKET_PAIRS[i][0];
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int get_bracket_pair_kind(SurroundingKind kind) {
+    switch (kind) {
+    case SurroundingKind::Parentheses: return 0;
+    case SurroundingKind::Brackets: return 1;
+    case SurroundingKind::Braces: return 2;
+    case SurroundingKind::AngleBrackets: return 3;
+    default: return -1;
+    }
+}
+
+const BracketPairIndex &VimEditor::get_bracket_pair_index() {
+    if (bracket_pair_index && bracket_pair_index->buffer_revision == buffer.get_revision()) {
+        return *bracket_pair_index;
+    }
+
+    BracketPairIndex index;
+    index.buffer_revision = buffer.get_revision();
+    // indices of the opening brackets which are not closed yet
+    std::array<std::vector<int>, 4> open_brackets;
+
+    QString text = buffer.to_string();
+    const QChar *data = text.constData();
+    for (int position = 0; position < text.size(); position++) {
+        // all the brackets are in ['(', '}']
+        ushort code = data[position].unicode();
+        if (code < '(' || code > '}') {
+            continue;
+        }
+
+        bool is_opening;
+        int kind = get_bracket_pair_kind(data[position], is_opening);
+        if (kind == -1) {
+            continue;
+        }
+
+        BracketPairIndex::Pairs &pairs = index.pairs[kind];
+        std::vector<int> &stack = open_brackets[kind];
+        int bracket_index = pairs.positions.size();
+        pairs.positions.push_back(position);
+        pairs.matches.push_back(-1);
+
+        if (is_opening) {
+            stack.push_back(bracket_index);
+            if (pairs.openings_by_depth.size() < stack.size()) {
+                pairs.openings_by_depth.emplace_back();
+            }
+            pairs.openings_by_depth[stack.size() - 1].push_back(bracket_index);
+        }
+        else if (!stack.empty()) {
+            pairs.matches[bracket_index] = stack.back();
+            pairs.matches[stack.back()] = bracket_index;
+            stack.pop_back();
+        }
+        pairs.depths.push_back(stack.size());
+    }
+
+    bracket_pair_index = std::make_unique<BracketPairIndex>(std::move(index));
+    return *bracket_pair_index;
+}
+
+int VimEditor::find_matching_bracket(int position) {
+    if (position < 0 || position >= buffer.length()) {
+        return -1;
+    }
+
+    bool is_opening;
+    int kind = get_bracket_pair_kind(buffer[position], is_opening);
+    if (kind == -1) {
+        return -1;
+    }
+
+    const BracketPairIndex::Pairs &pairs = get_bracket_pair_index().pairs[kind];
+    int bracket_index = std::lower_bound(pairs.positions.begin(), pairs.positions.end(), position) - pairs.positions.begin();
+    int match = pairs.matches[bracket_index];
+    return match == -1 ? -1 : pairs.positions[match];
+}
+
+bool VimEditor::find_enclosing_brackets(SurroundingKind kind, int position, int &begin, int &end) {
+    int pair_kind = get_bracket_pair_kind(kind);
+    if (pair_kind == -1) {
+        return false;
+    }
+    const BracketPairIndex::Pairs &pairs = get_bracket_pair_index().pairs[pair_kind];
 
-            if (action_waiting_for_motion.value().kind == ActionWaitingForMotionKind::Change) {
-                set_mode(VimMode::Insert);
-            }
-        }
+    // number of the brackets before `position`, an opening bracket at `position` is counted too
+    int count = std::upper_bound(pairs.positions.begin(), pairs.positions.end(), position) - pairs.positions.begin();
+    if (count > 0 && pairs.positions[count - 1] == position && buffer[position] == BRACKET_PAIRS[pair_kind][1]) {
+        count--;
+    }
 
-        if (action_waiting_for_motion.value().kind == ActionWaitingForMotionKind::Visual) {
-            set_cursor_position_with_selection(new_pos);
-        }
+    int depth = count > 0 ? pairs.depths[count - 1] : 0;
+    if (depth == 0) {
+        return false;
+    }
 
-        action_waiting_for_motion = {};
+    // the last opening bracket at this depth is the innermost one which is still open at `position`
+    const std::vector<int> &openings = pairs.openings_by_depth[depth - 1];
+    int opening = *(std::upper_bound(openings.begin(), openings.end(), count - 1) - 1);
+    int closing = pairs.matches[opening];
+    if (closing == -1) {
+        return false;
+    }
+
+    begin = pairs.positions[opening];
+    end = pairs.positions[closing];
+    return true;
+}
+
+void VimEditor::replace_buffer_text(int position, int chars_removed, const QString &text) {
+    bool is_index_valid = search_match_index.has_value() &&
+                          search_match_index->buffer_revision == buffer.get_revision() &&
+                          search_match_index->query.size() > 0;
+
+    buffer.replace(position, chars_removed, text);
+
+    if (!is_index_valid) {
+        search_match_index = {};
+        return;
+    }
+
+    // only the matches which overlap the edited range can change, the ones after it are just shifted
+    std::vector<int> &matches = search_match_index->match_positions;
+    int query_length = search_match_index->query.size();
+    int size_change = text.size() - chars_removed;
+
+    auto first = std::lower_bound(matches.begin(), matches.end(), position - query_length + 1);
+    auto last = std::lower_bound(first, matches.end(), position + chars_removed);
+    for (auto it = last; it != matches.end(); ++it) {
+        *it += size_change;
     }
+    first = matches.erase(first, last);
+
+    int range_begin = std::max(position - query_length + 1, 0);
+    int range_end = position + text.size() + query_length - 1;
+    QString range_text = buffer.mid(range_begin, range_end - range_begin).toLower();
+    std::vector<int> new_matches = find_all_matches(range_text, search_match_index->query, range_begin);
+    matches.insert(first, new_matches.begin(), new_matches.end());
+
+    search_match_index->buffer_revision = buffer.get_revision();
 }
 
 void VimEditor::handle_search(bool reverse){
@@ -2304,57 +4675,30 @@ void VimEditor::handle_search(bool reverse){
         return;
     }
 
-    QString document_text = adapter->get_text().toLower();
-    QString text = last_search_state->query.value().toLower();
+    const std::vector<int> &found_indices = get_search_matches(last_search_state->query.value());
 
-    int from = 0;
-    std::vector<int> found_indices;
-    while (from < document_text.length()) {
-        int index = document_text.indexOf(text, from);
-        if (index == -1) {
-            break; // No more occurrences found
-        }
-        found_indices.push_back(index);
-        from = index + text.length(); // Move past the found occurrence
-    }
-    
     if (found_indices.empty()) {
         return; // No matches found
     }
-    
+
     int current_pos = get_cursor_position();
     int target_index = -1;
-    bool is_reversed = last_search_state->direction == FindDirection::Forward 
+    bool is_reversed = last_search_state->direction == FindDirection::Forward
                        ? reverse
                        : !reverse;
-    
+
     if (is_reversed) {
         // Search backward: find the last occurrence before current position
-        for (int i = found_indices.size() - 1; i >= 0; i--) {
-            if (found_indices[i] < current_pos) {
-                target_index = found_indices[i];
-                break;
-            }
-        }
+        auto it = std::lower_bound(found_indices.begin(), found_indices.end(), current_pos);
         // If no occurrence before current position, wrap to the last occurrence
-        if (target_index == -1) {
-            target_index = found_indices.back();
-        }
+        target_index = (it == found_indices.begin()) ? found_indices.back() : *(it - 1);
     } else {
         // Search forward: find the first occurrence after current position
-        for (int index : found_indices) {
-            if (index > current_pos) {
-                target_index = index;
-                break;
-            }
-        }
+        auto it = std::upper_bound(found_indices.begin(), found_indices.end(), current_pos);
         // If no occurrence after current position, wrap to the first occurrence
-        if (target_index == -1) {
-            target_index = found_indices[0];
-        }
+        target_index = (it == found_indices.end()) ? found_indices.front() : *it;
     }
 
-    
     if (target_index != -1) {
         set_cursor_position(target_index);
     }
@@ -2392,7 +4736,7 @@ void EscapeLineEdit::keyPressEvent(QKeyEvent *event) {
 
 void VimEditor::set_last_deleted_text(QString text, std::optional<char> reg, bool is_line){
     if (reg.has_value()){
-        if (reg.value() == '+' || reg.value() == '*'){
+        if ((reg.value() == '+' || reg.value() == '*') && editor_widget != nullptr){
             // set the contents of the system clipboard
             QClipboard *clipboard = QApplication::clipboard();
             clipboard->setText(text);
@@ -2414,7 +4758,7 @@ void VimEditor::set_last_deleted_text(QString text, std::optional<char> reg, boo
 
 std::optional<LastDeletedTextState> VimEditor::get_last_deleted_text(std::optional<char> reg){
     if (reg.has_value()){
-        if (reg.value() == '+' || reg.value() == '*'){
+        if ((reg.value() == '+' || reg.value() == '*') && editor_widget != nullptr){
             // return the contents of the system clipboard
             QClipboard *clipboard = QApplication::clipboard();
             LastDeletedTextState clipboard_state;
@@ -2434,7 +4778,6 @@ std::optional<LastDeletedTextState> VimEditor::get_last_deleted_text(std::option
 }
 
 void VimEditor::handle_number_increment_decrement(bool increment, int count, bool progressive) {
-    QString current_text = adapter->get_text();
     int cursor_pos = get_cursor_position();
 
     bool has_selection = false;
@@ -2447,35 +4790,8 @@ void VimEditor::handle_number_increment_decrement(bool increment, int count, boo
     }
 
     if (has_selection) {
-        // Build all lines ranges
-        struct Line {
-            int start;
-            int end;
-        };
-        std::vector<Line> all_lines;
-        int text_len = current_text.length();
-        int p = 0;
-        while (p <= text_len) {
-            int l_start = p;
-            while (p < text_len && current_text[p] != '\n') {
-                p++;
-            }
-            all_lines.push_back({l_start, p});
-            p++; // skip '\n'
-        }
-
-        auto get_line_index_of_pos = [&](int pos) -> int {
-            for (size_t i = 0; i < all_lines.size(); ++i) {
-                int line_limit = (i + 1 < all_lines.size()) ? all_lines[i + 1].start : all_lines[i].end + 1;
-                if (pos >= all_lines[i].start && pos < line_limit) {
-                    return static_cast<int>(i);
-                }
-            }
-            return static_cast<int>(all_lines.size() - 1);
-        };
-
-        int start_line_idx = get_line_index_of_pos(begin);
-        int end_line_idx = get_line_index_of_pos(std::max(begin, end - 1));
+        int start_line_idx = buffer.line_number(begin);
+        int end_line_idx = buffer.line_number(std::max(begin, end - 1));
         if (start_line_idx > end_line_idx) {
             std::swap(start_line_idx, end_line_idx);
         }
@@ -2490,15 +4806,15 @@ void VimEditor::handle_number_increment_decrement(bool increment, int count, boo
         // Process from bottom to top so length changes don't shift earlier line boundaries
         for (int j = static_cast<int>(selected_line_indices.size()) - 1; j >= 0; --j) {
             int i = selected_line_indices[j];
-            int L_start = all_lines[i].start;
-            int L_end = all_lines[i].end;
+            int L_start = i == 0 ? 0 : buffer.newline_position(i - 1) + 1;
+            int L_end = buffer.line_end_position(L_start);
 
             int sel_start = std::max(L_start, begin);
             int sel_end = std::min(L_end, end);
             int relative_sel_start = sel_start - L_start;
             int relative_sel_end = sel_end - L_start;
 
-            QString line_text = current_text.mid(L_start, L_end - L_start);
+            QString line_text = buffer.mid(L_start, L_end - L_start);
             QRegularExpression number_regex("(-?\\d+)");
             QRegularExpressionMatchIterator matches = number_regex.globalMatch(line_text);
             
@@ -2540,12 +4856,12 @@ void VimEditor::handle_number_increment_decrement(bool increment, int count, boo
 
         // Return to normal mode, clear highlights and position cursor
         if (visual_line_selection_begin != -1) {
-            adapter->set_extra_selections(QList<QTextEdit::ExtraSelection>());
+            adapter->set_extra_selection_layer(VISUAL_SELECTION_LAYER, {});
             visual_line_selection_begin = -1;
             visual_line_selection_end = -1;
         }
         if (current_mode == VimMode::Visual) {
-            adapter->set_extra_selections(QList<QTextEdit::ExtraSelection>());
+            adapter->set_extra_selection_layer(VISUAL_SELECTION_LAYER, {});
         }
         set_mode(VimMode::Normal);
         set_cursor_position(new_cursor_pos);
@@ -2557,7 +4873,7 @@ void VimEditor::handle_number_increment_decrement(bool increment, int count, boo
         int line_end = get_line_end_position(cursor_pos);
         
         // Extract current line
-        QString line = current_text.mid(line_start, line_end - line_start);
+        QString line = buffer.mid(line_start, line_end - line_start);
         
         // Find the next number on the line starting from cursor position
         QRegularExpression number_regex("(-?\\d+)");
@@ -2618,10 +4934,17 @@ void VimEditor::set_mode(VimMode mode){
         last_insert_mode_text = current_insert_mode_text;
     }
 
+    bool was_visual = current_mode == VimMode::Visual || current_mode == VimMode::VisualLine;
     current_mode = mode;
 
     if (mode == VimMode::Insert){
         current_insert_mode_text = "";
+        // e.g. `a` in visual mode, the typed text must not replace the selection which is still there
+        if (was_visual) {
+            adapter->set_extra_selection_layer(VISUAL_SELECTION_LAYER, {});
+            visual_line_selection_begin = -1;
+            visual_line_selection_end = -1;
+        }
     }
 
     if (mode == VimMode::Normal){
@@ -2635,33 +4958,33 @@ void VimEditor::remove_text(int begin, int num){
     insert_text("", begin, begin + num);
 }
 
-void VimEditor::insert_text(QString text, int left_index, int right_index){
+void VimEditor::insert_text(QString text, int left_index, int right_index, bool update_marks){
     if (right_index == -1){
         right_index  = left_index;
     }
 
-    std::vector<int> marks_to_delete;
+    // some commands (e.g. pasting after the cursor on an empty last line) insert past the end
+    left_index = std::clamp(left_index, 0, buffer.size());
+    right_index = std::clamp(right_index, left_index, buffer.size());
 
-    for (auto& [name, mark] : marks){
-        if (mark.position >= left_index && (mark.position < right_index)){
-            marks_to_delete.push_back(name);
-        }
-        else if (mark.position >= left_index){
-            mark.position -= (right_index - left_index);
-            mark.position += text.size();
-        }
+    EditDelta delta;
+    delta.position = left_index;
+    delta.removed_text = buffer.mid(left_index, right_index - left_index);
+    delta.inserted_text = text;
+    if (update_marks) {
+        delta.removed_marks = update_marks_for_edit(left_index, right_index, text.size());
     }
 
-    for (int mark_to_delete : marks_to_delete){
-        auto it = marks.find(mark_to_delete);
-        if (it != marks.end()) {
-            marks.erase(it);
-        }
-    }
+    replace_buffer_text(left_index, right_index - left_index, text);
+    is_applying_edit = true;
+    adapter->replace_range(left_index, right_index, text);
+    is_applying_edit = false;
 
-    QString old_text = adapter->get_text();
-    QString new_text = old_text.mid(0, left_index) + text + old_text.mid(right_index);
-    adapter->set_text(new_text);
+    add_delta_to_history(std::move(delta));
+}
+
+std::vector<Mark> VimEditor::update_marks_for_edit(int begin, int end, int inserted_length){
+    return marks.update_for_edit(begin, end, inserted_length);
 }
 
 void VimEditor::add_event_to_current_macro(QKeyEvent *event){
@@ -2755,6 +5078,12 @@ void VimEditor::handle_text_command(QString text){
             emit text_edit->forceQuitCommand();
         }
     }
+    else if (text.startsWith("set iskeyword=") || text.startsWith("set isk=")){
+        QString option = text.mid(text.indexOf('=') + 1);
+        if (!set_iskeyword(option)){
+            qDebug() << "Invalid iskeyword: " << option;
+        }
+    }
 
     else {
         qDebug() << "Unknown command: " << text;
@@ -2766,6 +5095,32 @@ int VimEditor::get_cursor_position() const {
 }
 
 QLineEditAdapter::QLineEditAdapter(QLineEdit *line_edit) : line_edit(line_edit) {
+    previous_text = line_edit->text();
+
+    QObject::connect(line_edit, &QLineEdit::textChanged, line_edit, [this](const QString &new_text) {
+        // QLineEdit doesn't tell us which part of the text was changed, so we find the
+        // changed range by skipping the common prefix and suffix
+        int prefix_length = 0;
+        int max_prefix_length = std::min(previous_text.size(), new_text.size());
+        while (prefix_length < max_prefix_length && previous_text[prefix_length] == new_text[prefix_length]) {
+            prefix_length++;
+        }
+
+        int suffix_length = 0;
+        int max_suffix_length = max_prefix_length - prefix_length;
+        while (suffix_length < max_suffix_length &&
+               previous_text[previous_text.size() - suffix_length - 1] == new_text[new_text.size() - suffix_length - 1]) {
+            suffix_length++;
+        }
+
+        int chars_removed = previous_text.size() - prefix_length - suffix_length;
+        QString inserted_text = new_text.mid(prefix_length, new_text.size() - prefix_length - suffix_length);
+        previous_text = new_text;
+
+        if (text_changed_callback) {
+            text_changed_callback(prefix_length, chars_removed, inserted_text);
+        }
+    });
 }
 
 QString QLineEditAdapter::get_text() const {
@@ -2774,6 +5129,33 @@ QString QLineEditAdapter::get_text() const {
 
 QTextEditAdapter::QTextEditAdapter(QTextEdit* text_edit) : text_edit(text_edit) {
 
+    QObject::connect(text_edit->document(), &QTextDocument::contentsChange, text_edit, [this](int position, int chars_removed, int chars_added) {
+        if (!text_changed_callback) {
+            return;
+        }
+
+        QTextDocument *document = this->text_edit->document();
+        // the counts include the final paragraph separator when the whole document is replaced
+        int document_length = document->characterCount() - 1;
+        chars_added = std::max(std::min(chars_added, document_length - position), 0);
+
+        QTextCursor cursor(document);
+        cursor.setPosition(position);
+        cursor.setPosition(position + chars_added, QTextCursor::KeepAnchor);
+        QString inserted_text = cursor.selectedText();
+
+        // make the text the same as what toPlainText would return
+        for (QChar &ch : inserted_text) {
+            if (ch == QChar::ParagraphSeparator || ch == QChar::LineSeparator) {
+                ch = '\n';
+            }
+            else if (ch == QChar::Nbsp) {
+                ch = ' ';
+            }
+        }
+
+        text_changed_callback(position, chars_removed, inserted_text);
+    });
 }
 
 QString QTextEditAdapter::get_text() const {
@@ -2781,13 +5163,63 @@ QString QTextEditAdapter::get_text() const {
 }
 
 void QLineEditAdapter::set_cursor_width(int width) {
-    line_edit->setStyle(new LineEditStyle(width));
+    if (width == cursor_width) {
+        return;
+    }
+    cursor_width = width;
+
+    QStyle *old_style = cursor_style;
+    cursor_style = new LineEditStyle(width);
+    cursor_style->setParent(line_edit);
+    line_edit->setStyle(cursor_style);
+    delete old_style;
 }
 
 void QTextEditAdapter::set_cursor_width(int width) {
     text_edit->setCursorWidth(width);
 }
 
+static bool are_extra_selections_equal(const QList<QTextEdit::ExtraSelection> &first, const QList<QTextEdit::ExtraSelection> &second) {
+    if (first.size() != second.size()) {
+        return false;
+    }
+    for (int i = 0; i < first.size(); i++) {
+        if (first[i].cursor != second[i].cursor || first[i].format != second[i].format) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void TextInputAdapter::set_extra_selection_layer(int layer, const QList<QTextEdit::ExtraSelection> &selections) {
+    auto old_selections = selection_layers.find(layer);
+    bool is_unchanged = old_selections == selection_layers.end() ? selections.isEmpty() : are_extra_selections_equal(old_selections->second, selections);
+    if (is_unchanged) {
+        return;
+    }
+
+    if (selections.isEmpty()) {
+        selection_layers.erase(layer);
+    }
+    else {
+        selection_layers[layer] = selections;
+    }
+
+    QList<QTextEdit::ExtraSelection> all_selections;
+    for (const auto &[layer_index, layer_selections] : selection_layers) {
+        all_selections.append(layer_selections);
+    }
+    set_extra_selections(all_selections);
+}
+
+QList<QTextEdit::ExtraSelection> TextInputAdapter::get_extra_selection_layer(int layer) const {
+    auto selections = selection_layers.find(layer);
+    if (selections == selection_layers.end()) {
+        return {};
+    }
+    return selections->second;
+}
+
 void QTextEditAdapter::set_extra_selections(const QList<QTextEdit::ExtraSelection> &selections) {
     text_edit->setExtraSelections(selections);
 
@@ -2812,6 +5244,26 @@ void QLineEditAdapter::set_text(QString text) {
     line_edit->setText(text);
 }
 
+void QTextEditAdapter::replace_range(int begin, int end, const QString &text) {
+    QTextDocument *document = text_edit->document();
+
+    // VimEditor keeps its own undo history, so we don't want the document to keep another copy
+    // of our edits (this also matches the old behaviour of setPlainText clearing the undo stack)
+    document->setUndoRedoEnabled(false);
+
+    QTextCursor cursor(document);
+    cursor.setPosition(begin);
+    cursor.setPosition(end, QTextCursor::KeepAnchor);
+    cursor.insertText(text);
+
+    document->setUndoRedoEnabled(true);
+}
+
+void QLineEditAdapter::replace_range(int begin, int end, const QString &text) {
+    line_edit->setSelection(begin, end - begin);
+    line_edit->insert(text);
+}
+
 QList<QTextEdit::ExtraSelection> QTextEditAdapter::get_extra_selections() const {
     return text_edit->extraSelections();
 }
@@ -2843,7 +5295,7 @@ void QTextEditAdapter::set_visual_selection(int begin, int length) {
     selection.format.setBackground(selection_background_color);
     selection.format.setForeground(selection_foreground_color);
 
-    text_edit->setExtraSelections({selection});
+    set_extra_selection_layer(VISUAL_SELECTION_LAYER, {selection});
 }
 
 void QLineEditAdapter::set_visual_selection(int begin, int length) {
@@ -2886,15 +5338,11 @@ QString QLineEditAdapter::get_current_selection(int &begin, int &end) const {
 
 QString QTextEditAdapter::get_current_selection(int &begin, int &end) const {
     QTextCursor cursor = text_edit->textCursor();
-    auto extra_selections = text_edit->extraSelections();
-    for (auto selection : extra_selections){
-        if (selection.format.property(QTextFormat::UserProperty).toInt() != SEARCH_HIGHLIGHT_PROPERTY_INDEX){
-            cursor = selection.cursor;
-            break;
-        }
+    QList<QTextEdit::ExtraSelection> visual_selections = get_extra_selection_layer(VISUAL_SELECTION_LAYER);
+    if (!visual_selections.isEmpty()){
+        cursor = visual_selections.first().cursor;
     }
 
-
     begin = cursor.selectionStart();
     end = cursor.selectionEnd();
     return cursor.selectedText();
@@ -2932,6 +5380,130 @@ void QTextEditAdapter::key_press_event(QKeyEvent *kevent) {
     QCoreApplication::sendEvent(text_edit, kevent);
 }
 
+InMemoryTextAdapter::InMemoryTextAdapter(const QString &text) : text(text) {
+}
+
+QString InMemoryTextAdapter::get_text() const {
+    return text;
+}
+
+void InMemoryTextAdapter::edit_text(int begin, int end, const QString &new_text) {
+    // edits made by the "widget" itself, e.g. typing in insert mode
+    text.replace(begin, end - begin, new_text);
+    cursor_position = begin + new_text.size();
+    selection_begin = selection_end = -1;
+
+    if (text_changed_callback) {
+        text_changed_callback(begin, end - begin, new_text);
+    }
+}
+
+void InMemoryTextAdapter::set_text(QString new_text) {
+    int old_size = text.size();
+    text = new_text;
+    cursor_position = std::min<int>(cursor_position, text.size());
+    selection_begin = selection_end = -1;
+
+    if (text_changed_callback) {
+        text_changed_callback(0, old_size, text);
+    }
+}
+
+void InMemoryTextAdapter::replace_range(int begin, int end, const QString &new_text) {
+    text.replace(begin, end - begin, new_text);
+
+    cursor_position = get_position_after_edit(cursor_position, begin, end, new_text.size());
+    if (selection_begin != -1) {
+        selection_begin = get_position_after_edit(selection_begin, begin, end, new_text.size());
+        selection_end = get_position_after_edit(selection_end, begin, end, new_text.size());
+        // the selected text was removed, e.g. by a change in visual mode
+        if (selection_begin >= selection_end) {
+            selection_begin = selection_end = -1;
+        }
+    }
+}
+
+void InMemoryTextAdapter::set_cursor_width(int width) {
+}
+
+void InMemoryTextAdapter::set_extra_selections(const QList<QTextEdit::ExtraSelection> &selections) {
+    extra_selections = selections;
+    if (selections.size() == 0) {
+        selection_begin = selection_end = -1;
+    }
+}
+
+QList<QTextEdit::ExtraSelection> InMemoryTextAdapter::get_extra_selections() const {
+    return extra_selections;
+}
+
+void InMemoryTextAdapter::set_extra_selection_layer(int layer, const QList<QTextEdit::ExtraSelection> &selections) {
+    // the visual selection is not an extra selection here, but clearing its layer still ends it
+    if (layer == VISUAL_SELECTION_LAYER && selections.isEmpty()) {
+        selection_begin = selection_end = -1;
+    }
+    TextInputAdapter::set_extra_selection_layer(layer, selections);
+}
+
+void InMemoryTextAdapter::set_cursor_position(int pos) {
+    cursor_position = std::clamp(pos, 0, static_cast<int>(text.size()));
+}
+
+int InMemoryTextAdapter::get_cursor_position() const {
+    return cursor_position;
+}
+
+void InMemoryTextAdapter::set_visual_selection(int begin, int length) {
+    selection_begin = std::clamp(begin, 0, static_cast<int>(text.size()));
+    selection_end = std::clamp(begin + length, selection_begin, static_cast<int>(text.size()));
+}
+
+void InMemoryTextAdapter::set_cursor_position_with_selection(int pos, int anchor) {
+    // same as QTextEditAdapter, the character under the cursor is included in the selection
+    int selection_min = std::min<int>(anchor, pos);
+    int selection_max = std::max<int>(anchor, pos);
+    set_visual_selection(selection_min, selection_max - selection_min + 1);
+    cursor_position = std::clamp(pos, 0, static_cast<int>(text.size()));
+}
+
+QString InMemoryTextAdapter::get_current_selection(int &begin, int &end) const {
+    if (selection_begin == -1) {
+        begin = end = cursor_position;
+        return "";
+    }
+    begin = selection_begin;
+    end = selection_end;
+    return text.mid(begin, end - begin);
+}
+
+QTextDocument* InMemoryTextAdapter::get_document() {
+    return nullptr;
+}
+
+void InMemoryTextAdapter::set_focus() {
+}
+
+QFontMetrics InMemoryTextAdapter::get_font_metrics() {
+    // VimEditor doesn't use the font metrics of headless editors
+    return QFontMetrics(QFont());
+}
+
+void InMemoryTextAdapter::key_press_event(QKeyEvent *kevent) {
+    // there is no widget, so the keys which only a widget could handle are ignored
+    KeyAction action = get_key_action(kevent, cursor_position, selection_begin, selection_end, text.size(),
+        [&](int position) { return static_cast<int>(text.lastIndexOf('\n', position - 1) + 1); },
+        [&](int position) {
+            int line_end = text.indexOf('\n', position);
+            return static_cast<int>(line_end == -1 ? text.size() : line_end);
+        });
+    if (action.kind == KeyAction::Edit) {
+        edit_text(action.begin, action.end, action.text);
+    }
+    else if (action.kind == KeyAction::Move) {
+        set_cursor_position(action.position);
+    }
+}
+
 VimLineEdit::VimLineEdit(QWidget *parent) : QLineEdit(parent) {
     editor = new VimEditor(this);
 }
@@ -2943,8 +5515,7 @@ void VimLineEdit::keyPressEvent(QKeyEvent *event) {
 }
 
 void VimLineEdit::resizeEvent(QResizeEvent *event) {
-    editor->command_line_edit->resize(event->size().width(), editor->command_line_edit->height());
-    editor->command_line_edit->move(0, height() - editor->command_line_edit->height());
+    editor->update_command_line_edit_geometry();
     QLineEdit::resizeEvent(event);
 }
 
@@ -2961,23 +5532,33 @@ void LineNumberArea::paintEvent(QPaintEvent *event) {
 
 VimTextEdit::VimTextEdit(QWidget *parent) : QTextEdit(parent) {
     editor = new VimEditor(this);
+    // the gutter is created when the line numbers are shown
+}
+
+void VimTextEdit::create_line_number_area(){
     line_number_area = new LineNumberArea(this);
     line_number_area->hide();
+    last_cursor_block_number = textCursor().blockNumber();
 
-    QObject::connect(document(), &QTextDocument::blockCountChanged, this, [this]() {
-        update_line_number_area_width();
+    line_number_area_timer = new QTimer(this);
+    line_number_area_timer->setSingleShot(true);
+    line_number_area_timer->setInterval(0);
+    QObject::connect(line_number_area_timer, &QTimer::timeout, this, [this]() {
         update_line_number_area();
     });
+
+    QObject::connect(document(), &QTextDocument::blockCountChanged, this, [this]() {
+        schedule_line_number_area_update(true);
+    });
     QObject::connect(verticalScrollBar(), &QScrollBar::valueChanged, this, [this]() {
-        update_line_number_area();
+        schedule_line_number_area_update();
     });
     QObject::connect(this, &QTextEdit::textChanged, this, [this]() {
-        update_line_number_area();
+        schedule_line_number_area_update();
     });
     QObject::connect(this, &QTextEdit::cursorPositionChanged, this, [this]() {
-        update_line_number_area();
+        update_current_line_number();
     });
-    update_line_number_area_width();
 }
 
 void VimTextEdit::keyPressEvent(QKeyEvent *event) {
@@ -2987,10 +5568,9 @@ void VimTextEdit::keyPressEvent(QKeyEvent *event) {
 }
 
 void VimTextEdit::resizeEvent(QResizeEvent *event) {
-    editor->command_line_edit->resize(event->size().width(), editor->command_line_edit->height());
-    editor->command_line_edit->move(0, height() - editor->command_line_edit->height());
+    editor->update_command_line_edit_geometry();
     QTextEdit::resizeEvent(event);
-    update_line_number_area();
+    schedule_line_number_area_update(true);
 }
 
 
@@ -3015,60 +5595,178 @@ void VimTextEdit::set_line_numbers_visible(bool visible){
         return;
     }
 
+    if (line_number_area == nullptr){
+        create_line_number_area();
+    }
+
     line_numbers_visible = visible;
     line_number_area->setVisible(visible);
     update_line_number_area_width();
-    update_line_number_area();
+    schedule_line_number_area_update(true);
 }
 
 bool VimTextEdit::get_line_numbers_visible() const{
     return line_numbers_visible;
 }
 
-int VimTextEdit::line_number_area_width() const{
-    if (!line_numbers_visible){
-        return 0;
+void VimTextEdit::set_line_number_mode(LineNumberMode mode){
+    if (line_number_mode == mode){
+        return;
     }
 
+    line_number_mode = mode;
+    schedule_line_number_area_update();
+}
+
+LineNumberMode VimTextEdit::get_line_number_mode() const{
+    return line_number_mode;
+}
+
+int VimTextEdit::get_line_number_digits() const{
     int digits = 1;
     int max_line = std::max(1, document()->blockCount());
     while (max_line >= 10) {
         max_line /= 10;
         ++digits;
     }
+    return digits;
+}
+
+int VimTextEdit::line_number_area_width() const{
+    if (!line_numbers_visible){
+        return 0;
+    }
 
-    return 8 + fontMetrics().horizontalAdvance(QLatin1Char('9')) * digits;
+    return 8 + fontMetrics().horizontalAdvance(QLatin1Char('9')) * line_number_digits;
 }
 
 void VimTextEdit::update_line_number_area_width(){
+    line_number_digits = get_line_number_digits();
     setViewportMargins(line_number_area_width(), 0, 0, 0);
 }
 
+void VimTextEdit::schedule_line_number_area_update(bool update_geometry){
+    if (update_geometry){
+        is_line_number_area_geometry_dirty = true;
+    }
+    if (line_number_area_timer == nullptr){
+        return;
+    }
+    if (!line_number_area_timer->isActive()){
+        line_number_area_timer->start();
+    }
+}
+
 void VimTextEdit::update_line_number_area(){
     if (!line_number_area){
         return;
     }
 
-    QRect cr = contentsRect();
-    line_number_area->setGeometry(QRect(cr.left(), cr.top(), line_number_area_width(), cr.height()));
+    if (is_line_number_area_geometry_dirty){
+        is_line_number_area_geometry_dirty = false;
+        if (get_line_number_digits() != line_number_digits){
+            update_line_number_area_width();
+        }
+
+        QRect cr = contentsRect();
+        line_number_area->setGeometry(QRect(cr.left(), cr.top(), line_number_area_width(), cr.height()));
+    }
+
     if (line_numbers_visible){
         line_number_area->update();
     }
 }
 
+void VimTextEdit::update_line_number_strip(int block_number){
+    QTextBlock block = document()->findBlockByNumber(block_number);
+    if (!block.isValid()){
+        return;
+    }
+
+    QRectF block_rect = document()->documentLayout()->blockBoundingRect(block).translated(0, -verticalScrollBar()->value());
+    int height = std::max(qRound(block_rect.height()), fontMetrics().height());
+    line_number_area->update(0, qRound(block_rect.top()), line_number_area->width(), height);
+}
+
+void VimTextEdit::update_current_line_number(){
+    int cursor_block_number = textCursor().blockNumber();
+    if (cursor_block_number == last_cursor_block_number){
+        return;
+    }
+
+    if (line_numbers_visible){
+        if (line_number_mode == LineNumberMode::Absolute){
+            update_line_number_strip(last_cursor_block_number);
+            update_line_number_strip(cursor_block_number);
+        }
+        else{
+            // all the visible numbers change, the paint event only draws the visible lines
+            line_number_area->update();
+        }
+    }
+    last_cursor_block_number = cursor_block_number;
+}
+
+void VimTextEdit::update_digit_cache(){
+    QColor color = palette().color(QPalette::Mid);
+    qreal pixel_ratio = line_number_area->devicePixelRatioF();
+    if (digit_pixel_ratio == pixel_ratio && digit_font == font() && digit_color == color){
+        return;
+    }
+
+    QFontMetrics metrics = fontMetrics();
+    for (int digit = 0; digit < 10; digit++){
+        QString digit_text = QString::number(digit);
+        int width = metrics.horizontalAdvance(digit_text);
+
+        QPixmap pixmap(QSize(width, metrics.height()) * pixel_ratio);
+        pixmap.setDevicePixelRatio(pixel_ratio);
+        pixmap.fill(Qt::transparent);
+        QPainter painter(&pixmap);
+        painter.setFont(font());
+        painter.setPen(color);
+        painter.drawText(QRect(0, 0, width, metrics.height()), Qt::AlignLeft, digit_text);
+
+        digit_pixmaps[digit] = pixmap;
+        digit_widths[digit] = width;
+    }
+
+    digit_font = font();
+    digit_color = color;
+    digit_pixel_ratio = pixel_ratio;
+}
+
+void VimTextEdit::draw_line_number(QPainter *painter, int number, int right, int top){
+    // right aligned, so we draw the digits from the last one
+    int x = right;
+    do {
+        int digit = number % 10;
+        x -= digit_widths[digit];
+        painter->drawPixmap(x, top, digit_pixmaps[digit]);
+        number /= 10;
+    } while (number > 0);
+}
+
 void VimTextEdit::line_number_area_paint_event(QPaintEvent *event){
     if (!line_numbers_visible){
         return;
     }
 
+    update_digit_cache();
+
     QPainter painter(line_number_area);
     painter.setFont(font());
-    painter.setPen(palette().color(QPalette::Mid));
 
-    QTextBlock block = document()->firstBlock();
-    int block_number = 1;
     QAbstractTextDocumentLayout *layout = document()->documentLayout();
     QPointF offset(-horizontalScrollBar()->value(), -verticalScrollBar()->value());
+    QRect paint_rect = event->rect();
+
+    // start from the first block in the repainted rect instead of the beginning of the document
+    int first_position = layout->hitTest(QPointF(0, paint_rect.top()) - offset, Qt::FuzzyHit);
+    QTextBlock block = document()->findBlock(std::max(first_position, 0));
+    int block_number = block.blockNumber();
+    int cursor_block_number = textCursor().blockNumber();
+    int line_height = fontMetrics().height();
 
     QColor highlight_color = get_darker_color(palette().color(QPalette::Window));
 
@@ -3077,22 +5775,26 @@ void VimTextEdit::line_number_area_paint_event(QPaintEvent *event){
         int top = qRound(block_rect.top());
         int bottom = qRound(block_rect.bottom());
 
-        // highlight the focused line number
-        if (textCursor().blockNumber() == block_number - 1) {
-            painter.fillRect(0, top, line_number_area->width(), fontMetrics().height(), highlight_color);
-        }
-        if (bottom >= event->rect().top() && top <= event->rect().bottom()) {
-            painter.drawText(0, top, line_number_area->width() - 4, fontMetrics().height(),
-                             Qt::AlignRight, QString::number(block_number));
+        if (top > paint_rect.bottom()) {
+            break;
         }
 
-        if (top > event->rect().bottom()) {
-            break;
+        // highlight the focused line number
+        if (block_number == cursor_block_number) {
+            painter.fillRect(0, top, line_number_area->width(), line_height, highlight_color);
+        }
+        if (bottom >= paint_rect.top()) {
+            int line_number = block_number + 1;
+            if (line_number_mode == LineNumberMode::Relative ||
+                (line_number_mode == LineNumberMode::Hybrid && block_number != cursor_block_number)) {
+                line_number = std::abs(block_number - cursor_block_number);
+            }
+            draw_line_number(&painter, line_number, line_number_area->width() - 4, top);
         }
 
-        if (textCursor().blockNumber() == block_number - 1) {
+        if (block_number == cursor_block_number) {
             QString current_line_text = block.text();
-            custom_current_line_painter(block_number, current_line_text, &painter, QRect(0, top, line_number_area->width(), fontMetrics().height()));
+            custom_current_line_painter(block_number + 1, current_line_text, &painter, QRect(0, top, line_number_area->width(), line_height));
         }
 
         block = block.next();
@@ -3128,7 +5830,7 @@ void VimEditor::goto_begin(){
 }
 
 void VimEditor::goto_end(){
-    adapter->set_cursor_position(adapter->get_text().length() - 1);
+    adapter->set_cursor_position(buffer.length() - 1);
 }
 
 void VimTextEdit::focusInEvent(QFocusEvent* event){
@@ -3147,21 +5849,19 @@ void VimTextEdit::focusOutEvent(QFocusEvent* event){
 void VimEditor::push_current_history_state() {
 
     HistoryState state;
-    state.text = adapter->get_text();
     state.cursor_position = get_cursor_position();
-    history.states.push_back(state);
-    history.current_index++;
+    push_history(state);
 }
-bool is_separator(QChar ch){
-    return ch.isSpace() || ch == ';' || ch == '[' || ch == ']' || ch == '{' || ch == '}' || ch == '(' || ch == ')';
+bool is_separator(const WordClassifier &classifier, QChar ch){
+    return classifier.is_space(ch) || ch == ';' || ch == '[' || ch == ']' || ch == '{' || ch == '}' || ch == '(' || ch == ')';
 }
 
 QString VimEditor::get_word_under_cursor(){
     // get the word under the cursor
-    QString text = adapter->get_text();
+    const TextBuffer &text = buffer;
     int cursor_pos = get_cursor_position();
 
-    if (text.isEmpty()){
+    if (text.length() == 0){
         return "";
     }
 
@@ -3169,22 +5869,22 @@ QString VimEditor::get_word_under_cursor(){
         cursor_pos = text.length() - 1;
     }
 
-    if (is_separator(text[cursor_pos])){
+    if (is_separator(word_classifier, text[cursor_pos])){
         return "";
     }
 
     int pos = cursor_pos;
-    while (pos >= 0 && !is_separator(text[pos])){
+    while (pos >= 0 && !is_separator(word_classifier, text[pos])){
         pos--;
     }
 
     int word_begin = pos + 1;
-    if (pos == 0 && !is_separator(text[0])){
+    if (pos == 0 && !is_separator(word_classifier, text[0])){
         word_begin = 0;
     }
 
     pos = cursor_pos;
-    while (pos < text.length() && !is_separator(text[pos])){
+    while (pos < text.length() && !is_separator(word_classifier, text[pos])){
         pos++;
     }
 
@@ -3196,7 +5896,7 @@ QString VimEditor::get_word_under_cursor(){
 
 QString VimEditor::get_previous_word(){
     // get the word before the cursor
-    QString text = adapter->get_text();
+    const TextBuffer &text = buffer;
     int cursor_pos = get_cursor_position();
 
     if (cursor_pos == 0){
@@ -3204,12 +5904,12 @@ QString VimEditor::get_previous_word(){
     }
     int pos = cursor_pos - 1;
     // skip any whitespace before the word
-    while (pos >= 0 && !is_separator(text[pos])){
+    while (pos >= 0 && !is_separator(word_classifier, text[pos])){
         pos--;
     }
 
     int word_begin = pos + 1;
-    if (pos == 0 && !is_separator(text[0])){
+    if (pos == 0 && !is_separator(word_classifier, text[0])){
         word_begin = 0;
     }
 
@@ -8,15 +8,38 @@
 #include <string>
 #include <deque>
 #include <memory>
+#include <atomic>
+#include <functional>
 #include <unordered_map>
+#include <map>
+#include <array>
 #include <QTextEdit>
 #include <QTextCursor>
+#include <QTimer>
+#include <QPixmap>
 
 namespace QVimEditor {
 class VimTextEdit;
 
 QString swap_case(QString input);
 
+// implementations of the search functions below. the fastest one supported by the CPU is used by default.
+enum class SearchKernel {
+    Scalar,
+    SSE2,
+    AVX2,
+};
+SearchKernel get_search_kernel();
+// mainly for benchmarks, returns false if the CPU doesn't support `kernel`
+bool set_search_kernel(SearchKernel kernel);
+// e.g. "avx2", used in the benchmark reports
+const char *get_search_kernel_name(SearchKernel kernel);
+
+// index of the first/last occurrence in text[0, size) or -1 if there is none
+int find_char(const QChar *text, int size, QChar ch);
+int find_last_char(const QChar *text, int size, QChar ch);
+int find_substring(const QChar *text, int size, const QChar *needle, int needle_size);
+
 enum class VimLineEditCommand {
     GotoBegin,
     GotoEnd,
@@ -83,6 +106,7 @@ enum class VimLineEditCommand {
     GotoMark,
     RecordMacro,
     RepeatMacro,
+    RepeatLastChange,
     SearchTextUnderCursor,
     SearchTextUnderCursorBackward,
     GotoMatchingBracket,
@@ -141,9 +165,55 @@ struct ActionWaitingForMotion {
     SurroundingKind surrounding_kind = SurroundingKind::None;
 };
 
+// the last change in the normal mode, it is repeated by `.` without decoding its keys again
+struct RecordedChange {
+    // either a command or (when command is empty) the text object of the pending operator
+    struct Step {
+        std::optional<VimLineEditCommand> command = {};
+        std::optional<char> symbol = {};
+        QString repeat_number = "";
+        SurroundingScope surrounding_scope = SurroundingScope::None;
+        SurroundingKind surrounding_kind = SurroundingKind::None;
+    };
+
+    std::vector<Step> steps;
+    std::optional<char> paste_register = {};
+    bool enters_insert_mode = false;
+    // the text which was typed in the insert mode before returning to the normal mode
+    QString inserted_text = "";
+};
+
 QString to_string(VimLineEditCommand cmd);
 QString get_initial_command_text(VimLineEditCommand cmd);
 
+// latency statistics of a single command (or of all the key presses)
+struct CommandMetrics {
+    static constexpr int HISTOGRAM_BUCKETS = 25;
+
+    int count = 0;
+    qint64 total_ns = 0;
+    qint64 max_ns = 0;
+    // time spent in the adapter (i.e. in the widget) while executing the command
+    qint64 adapter_ns = 0;
+    qint64 total_buffer_size = 0;
+    int max_buffer_size = 0;
+    // bucket 0 counts the latencies below 1us and bucket i the ones in [2^(i-1), 2^i) us, the last
+    // bucket also contains everything which is slower
+    std::array<int, HISTOGRAM_BUCKETS> latency_histogram = {};
+
+    void add_sample(qint64 elapsed_ns, qint64 adapter_elapsed_ns, int buffer_size);
+    double get_mean_us() const;
+    // upper bound of the histogram bucket which contains the given percentile (0-100)
+    double get_percentile_us(double percentile) const;
+};
+
+struct EditorMetrics {
+    CommandMetrics key_presses;
+    std::map<VimLineEditCommand, CommandMetrics> commands;
+    // total time spent in the adapter calls since the metrics were enabled
+    qint64 adapter_ns = 0;
+};
+
 struct KeyboardModifierState {
     bool shift = false;
     bool control = false;
@@ -166,14 +236,43 @@ struct KeyBinding {
     VimLineEditCommand command;
 };
 
-struct InputTreeNode {
-    KeyChord key_chord;
-    std::vector<InputTreeNode> children;
-    std::optional<VimLineEditCommand> command;
+// keybindings of a mode. the key chords of the bindings form a tree, and instead of scanning the
+// children of the current node, (node, key, modifiers) is looked up in a hash table.
+class Keymap {
+  public:
+    static const int ROOT_NODE = 0;
+
+    Keymap();
+
+    // replaces the command if the key chords are already bound
+    void add_keybinding(const std::vector<KeyChord> &key_chords, VimLineEditCommand command);
 
-    void add_keybinding(const std::vector<KeyChord> &key_chords, int index, VimLineEditCommand cmd);
+    // returns the child of `node` which matches the key press, or -1 if there is none
+    int find_child(int node, const QString &event_text, int key, const KeyboardModifierState &modifiers) const;
+    std::optional<VimLineEditCommand> get_command(int node) const;
 
-    InputTreeNode clone() const;
+  private:
+    struct Transition {
+        int child;
+        // when more than one child matches the key press, the one which was added first is used
+        int order;
+    };
+
+    // text chords which are not a single character (they are very rare), these are scanned linearly
+    struct TextTransition {
+        int node;
+        QString text;
+        int modifiers;
+        Transition transition;
+    };
+
+    std::vector<std::optional<VimLineEditCommand>> node_commands;
+    std::unordered_map<quint64, Transition> transitions;
+    std::vector<TextTransition> text_transitions;
+    int transition_count = 0;
+
+    static quint64 get_transition_key(int node, bool is_text, int modifiers, int key);
+    int get_or_add_child(int node, const KeyChord &key_chord);
 };
 
 enum class VimMode {
@@ -183,6 +282,15 @@ enum class VimMode {
     VisualLine,
 };
 
+// how VimTextEdit's gutter numbers the lines, like vim's number and relativenumber options
+enum class LineNumberMode {
+    Absolute,
+    // the distance from the cursor's line, the cursor's line is 0
+    Relative,
+    // the distance from the cursor's line, the cursor's line shows its absolute number
+    Hybrid,
+};
+
 enum class FindDirection {
     Forward,
     Backward,
@@ -200,15 +308,234 @@ struct SearchState {
     std::optional<QString> query;
 };
 
+// positions of all the (case insensitive) matches of the last search query, so that pressing
+// n/N doesn't need to search the whole text. It is kept up to date when the text is edited.
+struct SearchMatchIndex {
+    // lowercase query
+    QString query;
+    int buffer_revision = -1;
+    std::vector<int> match_positions;
+};
+
+// matches of the incremental search which are highlighted. We only search the visible part
+// of the text (plus a margin), which is [begin, end).
+struct SearchHighlightState {
+    QString pattern;
+    int begin = 0;
+    int end = 0;
+    int buffer_revision = -1;
+    std::vector<int> match_positions;
+};
+
+enum class CharClass : unsigned char {
+    Space,
+    Punctuation,
+    Word,
+};
+
+// classes of the characters for the word motions and text objects. The Latin-1 characters are
+// looked up in a table built from an option in the format of vim's iskeyword (e.g. "@,48-57,_,192-255"),
+// the classes of the other characters come from their unicode properties and are cached.
+class WordClassifier {
+  public:
+    WordClassifier();
+
+    // returns false and keeps the current option if `option` can't be parsed
+    bool set_iskeyword(const QString &option);
+    QString get_iskeyword() const;
+
+    CharClass get_class(QChar ch) const;
+    bool is_space(QChar ch) const;
+    bool is_word(QChar ch) const;
+
+  private:
+    explicit WordClassifier(const QString &option);
+
+    std::array<CharClass, 256> latin1_classes;
+    QString iskeyword;
+};
+
+// matching brackets of the whole text for % and the bracket text objects (e.g. ci( or da{).
+// It is built when it is needed and rebuilt if the text has changed since then.
+struct BracketPairIndex {
+    // the brackets of one kind, e.g. ( and )
+    struct Pairs {
+        // positions of the opening and closing brackets in the text
+        std::vector<int> positions;
+        // index of the matching bracket in `positions`, -1 for the unmatched brackets
+        std::vector<int> matches;
+        // number of the opening brackets which are not closed after each bracket
+        std::vector<int> depths;
+        // indices of the opening brackets in `positions`, grouped by their depth (starting from 1)
+        std::vector<std::vector<int>> openings_by_depth;
+    };
+
+    int buffer_revision = -1;
+    // (), [], {} and <>
+    std::array<Pairs, 4> pairs;
+};
+
+// a single change to the text: `removed_text` at `position` was replaced by `inserted_text`
+struct EditDelta {
+    int position;
+    QString removed_text;
+    QString inserted_text;
+    // marks that were deleted because they were inside the removed text
+    std::vector<Mark> removed_marks;
+};
+
+// all the changes made by a single undoable command
 struct HistoryState {
-    QString text;
     int cursor_position;
-    std::unordered_map<int, Mark> marks;
+    std::vector<EditDelta> deltas;
+    qsizetype memory_usage = 0;
 };
 
 struct History {
     std::deque<HistoryState> states;
     int current_index = -1;
+    qsizetype memory_usage = 0;
+    qsizetype memory_budget = 16 * 1024 * 1024;
+};
+
+// piece table holding VimEditor's copy of the text. The pieces are kept in a treap together with the
+// length and the number of newlines of each subtree, so edits and finding a position or a line take
+// O(log pieces) and finding the beginning/end of a line doesn't require scanning the text.
+class TextBuffer {
+  public:
+    TextBuffer(const QString &text = "");
+
+    void set_text(const QString &text);
+    void replace(int position, int chars_removed, const QString &text);
+
+    int size() const;
+    int length() const;
+    QChar at(int position) const;
+    QChar operator[](int position) const;
+    QString mid(int position, int length = -1) const;
+    QString to_string() const;
+    int index_of(QChar ch, int from = 0) const;
+    int last_index_of(QChar ch, int from) const;
+
+    int line_count() const;
+    // number of the line that contains `position`
+    int line_number(int position) const;
+    // position of the `index`th newline character
+    int newline_position(int index) const;
+    int line_start_position(int position) const;
+    int line_end_position(int position) const;
+    // start of the first empty line (which is followed by a newline) after `position`, -1 if there is none
+    int next_empty_line(int position) const;
+    // start of the last empty line (which is followed by a newline) whose newline is before `position`,
+    // -1 if there is none
+    int previous_empty_line(int position) const;
+
+    // incremented on every change, so that results computed from the text can be cached
+    int get_revision() const;
+
+  private:
+    struct Piece {
+        bool is_added;
+        int start;
+        int length;
+        // range of the piece's newlines in original_newlines/added_newlines
+        int first_newline;
+        int newline_count;
+    };
+
+    struct Node {
+        Piece piece;
+        unsigned int priority;
+        int left = -1;
+        int right = -1;
+        // total length and number of newlines of the pieces in the subtree
+        int subtree_length;
+        int subtree_newlines;
+    };
+
+    QString original_text;
+    QString added_text;
+    std::vector<int> original_newlines;
+    std::vector<int> added_newlines;
+
+    std::vector<Node> nodes;
+    std::vector<int> free_nodes;
+    int root = -1;
+    unsigned int next_priority = 2463534242u;
+    int total_length = 0;
+    int total_newlines = 0;
+    int revision = 0;
+
+    mutable QString cached_text;
+    mutable bool is_cached_text_valid = false;
+    // most of the accesses are sequential, so we remember the last piece we used
+    mutable int last_piece_node = -1;
+    mutable int last_piece_position = 0;
+    mutable int last_piece_revision = -1;
+
+    Piece make_piece(bool is_added, int start, int length) const;
+    const QChar *piece_data(const Piece &piece) const;
+    const std::vector<int> &piece_newlines(const Piece &piece) const;
+    int new_node(const Piece &piece);
+    void update_node(int node);
+    int get_subtree_length(int tree) const;
+    int get_subtree_newlines(int tree) const;
+    // splits into the text before `position` and the text at or after it, the piece which contains
+    // `position` is split in two
+    void split(int tree, int position, int &before, int &after);
+    int merge(int before, int after);
+    void remove_subtree(int tree);
+    // appends [start, start + length) of added_text to the last piece of the tree if it ends right
+    // before it, returns false otherwise
+    bool extend_last_piece(int tree, int start, int length);
+    // returns the node of the piece containing `position` and the position of the piece
+    int find_piece(int position, int &piece_position) const;
+    // calls `visit(piece, piece_position)` for the pieces which end after `from` in order, until it returns false
+    bool visit_pieces_forward(int tree, int tree_position, int from, const std::function<bool(const Piece &, int)> &visit) const;
+    // calls `visit(piece, piece_position)` for the pieces which start at or before `from` in reverse order,
+    // until it returns false
+    bool visit_pieces_backward(int tree, int tree_position, int from, const std::function<bool(const Piece &, int)> &visit) const;
+};
+
+// marks ordered by their position in a treap. Shifting the marks after an edit only touches the
+// O(log n) nodes on the split path, the rest of them receive the offset lazily.
+class MarkTree {
+  public:
+    void set(int name, int position);
+    std::optional<int> get(int name) const;
+    void erase(int name);
+    int size() const;
+
+    // removes the marks in [begin, end) and returns them, the marks after them are moved as if
+    // the range was replaced by `inserted_length` characters
+    std::vector<Mark> update_for_edit(int begin, int end, int inserted_length);
+    // moves the marks which are after `position` by `offset`, they can't be moved before `position`
+    void shift_after(int position, int offset);
+
+  private:
+    struct Node {
+        int name;
+        // the position is only up to date after the `lazy_offset`s of all the ancestors are applied
+        int position;
+        int lazy_offset = 0;
+        unsigned int priority;
+        int left = -1;
+        int right = -1;
+        int parent = -1;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<int> free_nodes;
+    std::unordered_map<int, int> node_by_name;
+    int root = -1;
+    unsigned int next_priority = 2463534242u;
+
+    void push(int node);
+    void set_child(int parent, bool is_left, int child);
+    // splits into the marks before `position` and the marks at or after it
+    void split(int tree, int position, int &before, int &after);
+    int merge(int before, int after);
+    void remove_subtree(int tree, std::vector<Mark> &removed);
 };
 
 // same as QLineEdit but fires a signal when the escape key is pressed
@@ -229,13 +556,30 @@ struct LastDeletedTextState {
     bool is_line = false;
 };
 
+// the extra selections of an adapter are grouped into layers, the layers with higher indices are
+// painted on top of the others
+const int SEARCH_SELECTION_LAYER = 0;
+const int VISUAL_SELECTION_LAYER = 1;
+// the layers from this index on are not used by VimEditor, the application can use them for its own
+// highlights (e.g. to highlight errors)
+const int FIRST_USER_SELECTION_LAYER = 2;
+
 class TextInputAdapter {
+    std::map<int, QList<QTextEdit::ExtraSelection>> selection_layers;
   public:
+    virtual ~TextInputAdapter() = default;
     virtual QString get_text() const = 0;
     virtual void set_text(QString text) = 0;
+    // replaces the text in [begin, end) with `text` without touching the rest of the document
+    virtual void replace_range(int begin, int end, const QString &text) = 0;
     virtual void set_cursor_width(int width) = 0;
     virtual void set_extra_selections(const QList<QTextEdit::ExtraSelection> &selections) = 0;
     virtual QList<QTextEdit::ExtraSelection> get_extra_selections() const = 0;
+    // replaces the selections of a single layer. the selections of all the layers are passed to
+    // set_extra_selections only if the layer has actually changed, so setting the same search
+    // highlights or visual selection again doesn't make the widget repaint them
+    virtual void set_extra_selection_layer(int layer, const QList<QTextEdit::ExtraSelection> &selections);
+    virtual QList<QTextEdit::ExtraSelection> get_extra_selection_layer(int layer) const;
     virtual QString get_current_selection(int &begin, int &end) const = 0;
     virtual int get_cursor_position() const = 0;
     virtual void set_cursor_position(int pos) = 0;
@@ -245,15 +589,24 @@ class TextInputAdapter {
     virtual void set_focus() = 0;
     virtual QFontMetrics get_font_metrics() = 0;
     virtual void key_press_event(QKeyEvent *kevent) = 0;
+
+    // called when the widget changes its own text (e.g. when typing in insert mode) with the
+    // position of the change, the number of removed characters and the inserted text
+    std::function<void(int position, int chars_removed, const QString &inserted_text)> text_changed_callback;
 };
 
 class QLineEditAdapter : public TextInputAdapter {
   private:
+    QString previous_text;
+    // QLineEdit's cursor width can only be changed using a style, we only create one when the width changes
+    int cursor_width = 1;
+    QStyle *cursor_style = nullptr;
   public:
     QLineEdit *line_edit;
     QLineEditAdapter(QLineEdit *line_edit);
     QString get_text() const override;
     void set_text(QString text) override;
+    void replace_range(int begin, int end, const QString &text) override;
     void set_cursor_width(int width) override;
     virtual void set_extra_selections(const QList<QTextEdit::ExtraSelection> &selections) override;
     virtual QList<QTextEdit::ExtraSelection> get_extra_selections() const override;
@@ -275,9 +628,41 @@ class QTextEditAdapter : public TextInputAdapter {
     QTextEditAdapter(QTextEdit *text_edit);
     QString get_text() const override;
     void set_text(QString text) override;
+    void replace_range(int begin, int end, const QString &text) override;
+    void set_cursor_width(int width) override;
+    virtual void set_extra_selections(const QList<QTextEdit::ExtraSelection> &selections) override;
+    virtual QList<QTextEdit::ExtraSelection> get_extra_selections() const override;
+    virtual void set_cursor_position(int pos) override;
+    virtual int get_cursor_position() const override;
+    virtual void set_visual_selection(int begin, int length) override;
+    virtual void set_cursor_position_with_selection(int pos, int anchor) override;
+    virtual QString get_current_selection(int &begin, int &end) const override;
+    virtual QTextDocument *get_document() override;
+    virtual void set_focus() override;
+    virtual QFontMetrics get_font_metrics() override;
+    virtual void key_press_event(QKeyEvent *kevent) override;
+};
+
+// adapter which keeps the text in memory instead of in a widget, it can be used to run VimEditor
+// without any widgets (e.g. to apply vim commands to many strings in a batch tool or in tests)
+class InMemoryTextAdapter : public TextInputAdapter {
+  private:
+    QString text;
+    int cursor_position = 0;
+    int selection_begin = -1;
+    int selection_end = -1;
+    QList<QTextEdit::ExtraSelection> extra_selections;
+
+    void edit_text(int begin, int end, const QString &new_text);
+  public:
+    InMemoryTextAdapter(const QString &text = "");
+    QString get_text() const override;
+    void set_text(QString text) override;
+    void replace_range(int begin, int end, const QString &text) override;
     void set_cursor_width(int width) override;
     virtual void set_extra_selections(const QList<QTextEdit::ExtraSelection> &selections) override;
     virtual QList<QTextEdit::ExtraSelection> get_extra_selections() const override;
+    virtual void set_extra_selection_layer(int layer, const QList<QTextEdit::ExtraSelection> &selections) override;
     virtual void set_cursor_position(int pos) override;
     virtual int get_cursor_position() const override;
     virtual void set_visual_selection(int begin, int length) override;
@@ -293,11 +678,14 @@ class VimEditor {
   private:
     VimMode current_mode = VimMode::Insert;
     int visual_mode_anchor = -1;
-    InputTreeNode normal_mode_input_tree;
-    InputTreeNode visual_mode_input_tree;
-    InputTreeNode insert_mode_input_tree;
+    // the default keymaps are shared by all the editors, an editor only gets its own copy of a
+    // keymap when a keybinding is added to it
+    std::shared_ptr<const Keymap> normal_mode_keymap;
+    std::shared_ptr<const Keymap> visual_mode_keymap;
+    std::shared_ptr<const Keymap> insert_mode_keymap;
 
-    InputTreeNode *current_node = nullptr;
+    // node of the current mode's keymap for the keys which are typed so far, -1 if no keys are typed
+    int current_keymap_node = -1;
 
     std::optional<VimLineEditCommand> pending_symbol_command = {};
     std::optional<VimLineEditCommand> pending_text_command = {};
@@ -312,30 +700,93 @@ class VimEditor {
     QString current_insert_mode_text = "";
     QString current_command_repeat_number = "";
 
-    std::unordered_map<int, Mark> marks;
+    MarkTree marks;
     std::unordered_map<int, Macro> macros;
     std::optional<Macro> current_macro = {};
     std::optional<char> current_paste_register = {};
     int last_macro_symbol = -1;
 
+    WordClassifier word_classifier;
+
+    std::optional<RecordedChange> last_change = {};
+    // the change which is being typed, it becomes the last change when we return to the normal mode
+    std::optional<RecordedChange> pending_change = {};
+    bool is_repeating_change = false;
+
     std::optional<FindState> last_find_state = {};
     std::optional<SearchState> last_search_state = {};
+    std::optional<SearchHighlightState> search_highlight_state = {};
+    std::optional<SearchMatchIndex> search_match_index = {};
+    // allocated by the first bracket command, most of the editors never need it
+    std::unique_ptr<BracketPairIndex> bracket_pair_index;
+    // search highlights are computed on a worker thread after the user stops typing for a moment.
+    // incrementing the generation cancels the searches which are still running.
+    QTimer *search_highlight_timer = nullptr;
+    QString pending_search_highlight_pattern;
+    std::shared_ptr<std::atomic<int>> search_highlight_generation = std::make_shared<std::atomic<int>>(0);
     History history;
+    // copy of the adapter's text which is kept in sync with the widget, so that we don't have
+    // to ask the widget for its whole text every time we need to read it
+    TextBuffer buffer;
+    bool is_applying_edit = false;
     int visual_line_selection_begin = -1;
     int visual_line_selection_end = -1;
+    // the extra selection of the visual line mode, only its endpoints are updated when the cursor moves
+    QTextEdit::ExtraSelection visual_line_selection;
 
     void set_style_for_mode(VimMode mode);
+    // the widget switches to a monospace font the first time it leaves the insert mode, so that the
+    // block cursor has the width of the characters
+    bool is_monospace_font_set = false;
+    void set_monospace_font();
+    // nullptr for headless editors which are not attached to any widget
     QWidget* editor_widget = nullptr;
+    // headless editors don't have a command line widget, so we keep its text here
+    std::optional<QString> headless_command_line_text = {};
+
+    // nullptr when the metrics are disabled, so measuring costs a single branch per command
+    std::unique_ptr<EditorMetrics> metrics;
+    // while the metrics are enabled `adapter` points to a wrapper which measures the adapter calls
+    std::unique_ptr<TextInputAdapter> timed_adapter;
+    TextInputAdapter *untimed_adapter = nullptr;
+    TextInputAdapter *get_untimed_adapter() const;
+    bool process_key_press_event(QKeyEvent *event);
+    void execute_command(VimLineEditCommand cmd, std::optional<char> symbol);
+
+    // while a batch is open `adapter` only records the changed range and the widget is updated
+    // once when the batch is closed
+    int batch_depth = 0;
+    std::unique_ptr<TextInputAdapter> batch_adapter;
+    TextInputAdapter *adapter_before_batch = nullptr;
+    int batch_first_history_index = -1;
+    void merge_batch_history();
+    // swap the batch adapter in and out without ending the batch
+    void open_batch_adapter();
+    void close_batch_adapter();
+    // gives a key which VimEditor doesn't handle to the widget (or to the batch adapter if it can apply it)
+    void pass_key_to_adapter(QKeyEvent *event);
+
+    void initialize();
+    void create_command_line_edit();
+    void handle_headless_command_line_key(QKeyEvent *event);
 
   public:
-    EscapeLineEdit *command_line_edit;
+    // nullptr until the command line is shown for the first time
+    EscapeLineEdit *command_line_edit = nullptr;
     TextInputAdapter *adapter = nullptr;
     explicit VimEditor(QWidget *editor_widget);
+    // creates a headless editor which doesn't need any widgets (or a QApplication)
+    explicit VimEditor(TextInputAdapter *adapter);
+    ~VimEditor();
 
     bool key_press_event(QKeyEvent *event);
+    void handle_key(int key, Qt::KeyboardModifiers modifiers = Qt::NoModifier, const QString &text = "");
+    void update_command_line_edit_geometry();
 
     QString get_word_under_cursor_bounds(int &start, int &end);
     void add_vim_keybindings();
+    // bindings which are added to the normal mode are not added to the visual mode
+    void add_keybinding(VimMode mode, const std::vector<KeyChord> &key_chords, VimLineEditCommand command);
     std::optional<VimLineEditCommand> handle_key_event(QString event_text, int key,
                                                        Qt::KeyboardModifiers modifiers);
     void handle_command(VimLineEditCommand cmd, std::optional<char> symbol = {});
@@ -346,6 +797,26 @@ class VimEditor {
     void goto_begin();
     void goto_end();
     void push_current_history_state();
+    void set_undo_memory_budget(qsizetype budget_in_bytes);
+    qsizetype get_undo_memory_budget() const;
+    // the characters which are a part of words, in the format of vim's iskeyword option. It can
+    // also be set with :set iskeyword=...
+    bool set_iskeyword(const QString &option);
+    QString get_iskeyword() const;
+
+    // the widget is not updated until the outermost batch is closed, and all the changes in the
+    // batch are undone together. used for macros and counted edits (e.g. 500x).
+    void begin_batch();
+    void end_batch();
+
+    // measures the latency of the key presses and of each command, they are disabled by default.
+    // returns false (and does nothing) while a batch is open, e.g. when called while a macro runs
+    bool set_metrics_enabled(bool enabled);
+    bool get_metrics_enabled() const;
+    // nullptr when the metrics are disabled
+    const EditorMetrics *get_metrics() const;
+    void reset_metrics();
+    QByteArray get_metrics_json() const;
 
     // void resizeEvent(QResizeEvent* event);
 
@@ -364,7 +835,18 @@ class VimEditor {
     void delete_char(bool is_single);
     bool handle_surrounding_motion_action();
 
+    bool is_change_command(VimLineEditCommand cmd) const;
+    void record_change_step(RecordedChange::Step step);
+    void update_pending_change();
+    void repeat_last_change(int num_repeats);
+
     void push_history(HistoryState state);
+    void add_delta_to_history(EditDelta delta);
+    // returns false (and clears the history, including `delta`) if the text doesn't match the delta
+    bool apply_history_delta(const EditDelta &delta, bool reverse);
+    void enforce_undo_memory_budget();
+    void handle_adapter_text_change(int position, int chars_removed, const QString &inserted_text);
+    std::vector<Mark> update_marks_for_edit(int begin, int end, int inserted_length);
     void undo();
     void redo();
 
@@ -378,13 +860,24 @@ class VimEditor {
     void perform_pending_text_command_with_text(QString text);
     void handle_action_waiting_for_motion(int old_pos, int new_pos, int delete_pos_offset);
     void handle_search(bool reverse = false);
+    const std::vector<int> &get_search_matches(const QString &query);
+    const BracketPairIndex &get_bracket_pair_index();
+    // position of the bracket matching the one at `position` or -1
+    int find_matching_bracket(int position);
+    // the innermost pair of `kind` brackets around `position` (a bracket at `position` is a part of its own pair)
+    bool find_enclosing_brackets(SurroundingKind kind, int position, int &begin, int &end);
+    void replace_buffer_text(int position, int chars_removed, const QString &text);
     void highlight_matches(QString pattern);
+    void start_search_highlight_worker();
+    void apply_search_highlights(SearchHighlightState state);
+    void update_search_highlights_on_scroll();
+    void get_visible_text_range(int &begin, int &end);
     void set_last_deleted_text(QString text, std::optional<char> reg, bool is_line = false);
     std::optional<LastDeletedTextState> get_last_deleted_text(std::optional<char> reg);
 
     void handle_number_increment_decrement(bool increment, int count = 1, bool progressive = false);
     void remove_text(int begin, int num);
-    void insert_text(QString text, int left_index, int right_index = -1);
+    void insert_text(QString text, int left_index, int right_index = -1, bool update_marks = true);
     bool requires_symbol(VimLineEditCommand cmd);
     void add_event_to_current_macro(QKeyEvent *event);
     void set_visual_selection(int begin, int length);
@@ -433,12 +926,37 @@ class VimTextEdit : public QTextEdit {
     Q_OBJECT
     bool vim_enabled = true;
     bool line_numbers_visible = false;
+    LineNumberMode line_number_mode = LineNumberMode::Absolute;
+    // nullptr (with its timer) until the line numbers are shown for the first time
     LineNumberArea *line_number_area = nullptr;
     bool showing_suggestion_menu = false;
 
+    // the digits rendered with the gutter's font and color, the line numbers are drawn by copying them
+    std::array<QPixmap, 10> digit_pixmaps;
+    std::array<int, 10> digit_widths = {};
+    QFont digit_font;
+    QColor digit_color;
+    qreal digit_pixel_ratio = 0;
+    // when the cursor moves to another line, only the lines of the old and the new cursor position are
+    // repainted (or the whole gutter for the relative line numbers)
+    int last_cursor_block_number = -1;
+    // the gutter updates which are requested in an event loop iteration (e.g. by the signals of a
+    // single dd) are applied once when the timer fires
+    QTimer *line_number_area_timer = nullptr;
+    bool is_line_number_area_geometry_dirty = false;
+    // the width of the gutter only changes when the number of digits of the last line changes
+    int line_number_digits = 1;
+
+    int get_line_number_digits() const;
     int line_number_area_width() const;
     void update_line_number_area_width();
+    void create_line_number_area();
+    void schedule_line_number_area_update(bool update_geometry = false);
     void update_line_number_area();
+    void update_line_number_strip(int block_number);
+    void update_current_line_number();
+    void update_digit_cache();
+    void draw_line_number(QPainter *painter, int number, int right, int top);
     void line_number_area_paint_event(QPaintEvent *event);
 
   public:
@@ -450,6 +968,8 @@ class VimTextEdit : public QTextEdit {
     bool get_vim_enabled();
     void set_line_numbers_visible(bool visible);
     bool get_line_numbers_visible() const;
+    void set_line_number_mode(LineNumberMode mode);
+    LineNumberMode get_line_number_mode() const;
     void focusInEvent(QFocusEvent* event) override;
     void focusOutEvent(QFocusEvent* event) override;
     void show_autocomplete_suggestions(const QStringList &suggestions);
@@ -0,0 +1,121 @@
+#include <QApplication>
+#include <QElapsedTimer>
+#include <QLineEdit>
+#include <QString>
+#include <QTextEdit>
+#include <QVBoxLayout>
+#include <QWidget>
+#include <functional>
+#include <iostream>
+#include <vector>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#include "../VimLineEdit.h"
+
+using namespace QVimEditor;
+
+// measures how long it takes to create a form with many editors and how much memory each of them
+// uses, compared to the plain Qt widgets.
+// usage: vim_lineedit_construction_bench [--count widgets] [--repeat forms]
+
+// set by bench/CMakeLists.txt
+#ifndef VIM_LINEEDIT_BUILD_TYPE
+#define VIM_LINEEDIT_BUILD_TYPE "unknown"
+#endif
+
+struct WidgetKind {
+    QString name;
+    std::function<QWidget *()> create;
+};
+
+struct ConstructionResult {
+    double us_per_widget = 0;
+    // -1 if the allocator doesn't tell us how much memory is in use
+    double bytes_per_widget = -1;
+};
+
+long long get_allocated_bytes() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+    return (long long)mallinfo2().uordblks;
+#else
+    return -1;
+#endif
+}
+
+ConstructionResult run_kind(const WidgetKind &kind, int count, int repeat) {
+    ConstructionResult result;
+    double total_us = 0;
+
+    for (int i = 0; i < repeat; i++) {
+        QWidget *form = new QWidget;
+        form->setLayout(new QVBoxLayout);
+
+        long long bytes_before = get_allocated_bytes();
+        QElapsedTimer timer;
+        timer.start();
+        for (int j = 0; j < count; j++) {
+            form->layout()->addWidget(kind.create());
+        }
+        total_us += timer.nsecsElapsed() / 1e3;
+        long long bytes_after = get_allocated_bytes();
+
+        // the first form also pays for the one time initialization (e.g. the shared keymaps), the
+        // memory is measured on the last one
+        if (bytes_before >= 0 && bytes_after >= 0) {
+            result.bytes_per_widget = double(bytes_after - bytes_before) / count;
+        }
+        delete form;
+    }
+
+    result.us_per_widget = total_us / (double(count) * repeat);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    QApplication app(argc, argv);
+    int count = 1000;
+    int repeat = 5;
+
+    for (int i = 1; i < argc; i++) {
+        QString arg = argv[i];
+        if (arg == "--count" && i + 1 < argc) {
+            count = QString(argv[++i]).toInt();
+        }
+        else if (arg == "--repeat" && i + 1 < argc) {
+            repeat = QString(argv[++i]).toInt();
+        }
+        else {
+            std::cerr << "usage: vim_lineedit_construction_bench [--count widgets] [--repeat forms]" << std::endl;
+            return 1;
+        }
+    }
+    count = std::max(count, 1);
+    repeat = std::max(repeat, 1);
+
+    std::vector<WidgetKind> kinds = {
+        {"QLineEdit", []() -> QWidget * { return new QLineEdit; }},
+        {"VimLineEdit", []() -> QWidget * { return new VimLineEdit; }},
+        {"QTextEdit", []() -> QWidget * { return new QTextEdit; }},
+        {"VimTextEdit", []() -> QWidget * { return new VimTextEdit; }},
+    };
+
+    std::cout << "build type: " << VIM_LINEEDIT_BUILD_TYPE << std::endl;
+    std::cout << count << " widgets per form, " << repeat << " forms" << std::endl;
+    std::cout << "widget\tus/widget\tbytes/widget" << std::endl;
+    for (const WidgetKind &kind : kinds) {
+        ConstructionResult result = run_kind(kind, count, repeat);
+        std::cout << kind.name.toStdString() << "\t" << result.us_per_widget << "\t";
+        if (result.bytes_per_widget < 0) {
+            std::cout << "unknown";
+        }
+        else {
+            std::cout << int(result.bytes_per_widget);
+        }
+        std::cout << std::endl;
+    }
+
+    return 0;
+}
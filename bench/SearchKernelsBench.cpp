@@ -0,0 +1,84 @@
+#include <QElapsedTimer>
+#include <QString>
+#include <iostream>
+#include <vector>
+
+#include "../VimLineEdit.h"
+
+using namespace QVimEditor;
+
+// measures the throughput of the search kernels over large buffers which don't contain what we
+// are looking for, so that the whole buffer is scanned
+
+// set by bench/CMakeLists.txt
+#ifndef VIM_LINEEDIT_BUILD_TYPE
+#define VIM_LINEEDIT_BUILD_TYPE "unknown"
+#endif
+
+QString make_buffer(int size) {
+    // words and line breaks but no empty lines or '@'
+    QString text;
+    text.reserve(size);
+    const QString line = "the quick brown fox jumps over the lazy dog 0123456789 vim line edit\n";
+    while (text.size() < size) {
+        text += line;
+    }
+    text.truncate(size);
+    return text;
+}
+
+template <typename F> double measure_megabytes_per_second(int buffer_size, F search) {
+    int iterations = 0;
+    QElapsedTimer timer;
+    timer.start();
+    volatile int result = 0;
+    while (timer.elapsed() < 200) {
+        result = result + search();
+        iterations++;
+    }
+    double seconds = timer.nsecsElapsed() / 1e9;
+    double megabytes = double(buffer_size) * sizeof(QChar) * iterations / (1024 * 1024);
+    return megabytes / seconds;
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<int> sizes = {1 << 20, 8 << 20, 32 << 20};
+    QString needle = "\n\n";
+    QString long_needle = "lazy cat";
+
+    std::cout << "build type: " << VIM_LINEEDIT_BUILD_TYPE << std::endl;
+    std::cout << "kernel\tsize (MB)\tfind_char\tfind_last_char\tfind \"\\n\\n\"\tfind \"lazy cat\"\t(MB/s)" << std::endl;
+    for (SearchKernel kernel : {SearchKernel::Scalar, SearchKernel::SSE2, SearchKernel::AVX2}) {
+        if (!set_search_kernel(kernel)) {
+            std::cout << get_search_kernel_name(kernel) << "\tnot supported" << std::endl;
+            continue;
+        }
+
+        for (int size : sizes) {
+            QString text = make_buffer(size);
+            const QChar *data = text.constData();
+
+            double find_char_speed = measure_megabytes_per_second(size, [&]() {
+                return find_char(data, size, '@');
+            });
+            double find_last_char_speed = measure_megabytes_per_second(size, [&]() {
+                return find_last_char(data, size, '@');
+            });
+            double paragraph_speed = measure_megabytes_per_second(size, [&]() {
+                return find_substring(data, size, needle.constData(), needle.size());
+            });
+            double substring_speed = measure_megabytes_per_second(size, [&]() {
+                return find_substring(data, size, long_needle.constData(), long_needle.size());
+            });
+
+            std::cout << get_search_kernel_name(kernel) << "\t"
+                      << size * sizeof(QChar) / (1024 * 1024) << "\t"
+                      << int(find_char_speed) << "\t"
+                      << int(find_last_char_speed) << "\t"
+                      << int(paragraph_speed) << "\t"
+                      << int(substring_speed) << std::endl;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,257 @@
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QString>
+#include <algorithm>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "../VimLineEdit.h"
+
+using namespace QVimEditor;
+
+// drives headless VimEditors with synthetic buffers and reports the latency of each command.
+// usage: vim_lineedit_bench [--output results.json] [--max-size characters] [--time-budget ms]
+
+struct BufferConfig {
+    int size;
+    int line_length;
+    bool is_cjk;
+};
+
+struct BenchCommand {
+    QString name;
+    // keys which are typed before the measurement starts
+    QString setup_keys;
+    // keys of a single command, they are typed repeatedly and each repetition is timed
+    QString keys;
+    int max_iterations = 1000;
+};
+
+struct BenchResult {
+    int iterations = 0;
+    double total_seconds = 0;
+    double mean_us = 0;
+    double median_us = 0;
+    double p99_us = 0;
+    double max_us = 0;
+};
+
+// set by bench/CMakeLists.txt
+#ifndef VIM_LINEEDIT_BUILD_TYPE
+#define VIM_LINEEDIT_BUILD_TYPE "unknown"
+#endif
+
+QString make_buffer(const BufferConfig &config) {
+    const std::vector<QString> ascii_words = {"lorem", "ipsum", "dolor", "sit", "amet", "vim", "editor", "buffer", "[index]", "{block}"};
+    const std::vector<QString> cjk_words = {"编辑", "缓冲区", "文本", "光标", "行", "单词", "搜索", "撤销", "[索引]", "{块}"};
+    const std::vector<QString> &words = config.is_cjk ? cjk_words : ascii_words;
+
+    // every line starts with a bracket (for %) and every tenth line is empty (for })
+    std::mt19937 rng(1);
+    QString text;
+    text.reserve(config.size + config.line_length);
+    int line_index = 0;
+    while (text.size() < config.size) {
+        if (line_index % 10 == 9) {
+            text += "\n";
+        }
+        else {
+            int line_start = text.size();
+            text += "(" + words[rng() % words.size()] + ")";
+            while (text.size() - line_start < config.line_length) {
+                text += " " + words[rng() % words.size()];
+            }
+            text += "\n";
+        }
+        line_index++;
+    }
+    text.truncate(config.size);
+    return text;
+}
+
+// special keys are written as <Esc>, <CR> and <C-r>
+void type_keys(VimEditor &editor, const QString &keys) {
+    int index = 0;
+    while (index < keys.size()) {
+        if (keys.mid(index).startsWith("<Esc>")) {
+            editor.handle_key(Qt::Key_Escape);
+            index += 5;
+        }
+        else if (keys.mid(index).startsWith("<CR>")) {
+            editor.handle_key(Qt::Key_Return);
+            index += 4;
+        }
+        else if (keys.mid(index).startsWith("<C-r>")) {
+            editor.handle_key(Qt::Key_R, Qt::ControlModifier);
+            index += 5;
+        }
+        else {
+            QChar ch = keys[index];
+            Qt::KeyboardModifiers modifiers = ch.isUpper() ? Qt::ShiftModifier : Qt::NoModifier;
+            editor.handle_key(ch.toUpper().unicode(), modifiers, QString(ch));
+            index++;
+        }
+    }
+}
+
+BenchResult run_command(const QString &text, const BenchCommand &command, qint64 time_budget_ms) {
+    InMemoryTextAdapter adapter(text);
+    VimEditor editor(&adapter);
+    editor.set_mode(VimMode::Normal);
+    adapter.set_cursor_position(0);
+    type_keys(editor, command.setup_keys);
+
+    std::vector<double> latencies;
+    QElapsedTimer total_timer;
+    total_timer.start();
+    while ((int)latencies.size() < command.max_iterations && total_timer.elapsed() < time_budget_ms) {
+        QElapsedTimer timer;
+        timer.start();
+        type_keys(editor, command.keys);
+        latencies.push_back(timer.nsecsElapsed() / 1000.0);
+    }
+
+    BenchResult result;
+    result.iterations = latencies.size();
+    if (latencies.empty()) {
+        return result;
+    }
+
+    double total_us = 0;
+    for (double latency : latencies) {
+        total_us += latency;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    result.total_seconds = total_us / 1e6;
+    result.mean_us = total_us / latencies.size();
+    result.median_us = latencies[latencies.size() / 2];
+    result.p99_us = latencies[std::min<size_t>(latencies.size() * 99 / 100, latencies.size() - 1)];
+    result.max_us = latencies.back();
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    QString output_path;
+    int max_size = 50 * 1024 * 1024;
+    qint64 time_budget_ms = 1000;
+
+    for (int i = 1; i < argc; i++) {
+        QString arg = argv[i];
+        if (arg == "--output" && i + 1 < argc) {
+            output_path = argv[++i];
+        }
+        else if (arg == "--max-size" && i + 1 < argc) {
+            max_size = QString(argv[++i]).toInt();
+        }
+        else if (arg == "--time-budget" && i + 1 < argc) {
+            time_budget_ms = QString(argv[++i]).toLongLong();
+        }
+        else {
+            std::cerr << "usage: vim_lineedit_bench [--output results.json] [--max-size characters] [--time-budget ms]" << std::endl;
+            return 1;
+        }
+    }
+
+    QString repeated_undo_setup = QString("x").repeated(200);
+    QString long_word_setup = "O" + QString("é").repeated(4000) + "<Esc>";
+    std::vector<BenchCommand> commands = {
+        {"w", "", "w"},
+        {"e", "", "e"},
+        {"b", "G", "b"},
+        // moving over a long word, most of the time is spent classifying its characters
+        {"w (long word)", long_word_setup, "ggw"},
+        {"b (long word)", long_word_setup, "$b"},
+        {"j", "", "j"},
+        {"k", "G", "k"},
+        // extending a visual line selection
+        {"j (visual line)", "V", "j"},
+        {"%", "", "%"},
+        {"}", "", "}"},
+        {"x", "", "x"},
+        {"dd", "", "dd"},
+        {"p", "yy", "p"},
+        {"ciw", "", "ciwword<Esc>w"},
+        {"/", "", "/editor<CR>"},
+        {"n", "/editor<CR>", "n"},
+        {"u", repeated_undo_setup, "u", 200},
+        {"<C-r>", repeated_undo_setup + QString("u").repeated(200), "<C-r>", 200},
+        {"@a", "qajxq", "@a"},
+    };
+
+    std::vector<int> sizes = {1024, 64 * 1024, 1024 * 1024, 10 * 1024 * 1024, 50 * 1024 * 1024};
+    std::vector<BufferConfig> buffer_configs;
+    for (int size : sizes) {
+        if (size > max_size) continue;
+        for (int line_length : {40, 4000}) {
+            for (bool is_cjk : {false, true}) {
+                buffer_configs.push_back(BufferConfig{size, line_length, is_cjk});
+            }
+        }
+    }
+
+    QJsonArray results;
+    for (const BufferConfig &config : buffer_configs) {
+        QString text = make_buffer(config);
+        for (const BenchCommand &command : commands) {
+            // the CJK vocabulary doesn't contain the ASCII search query, search for one of its words instead.
+            // the long words are made of CJK characters too.
+            BenchCommand current_command = command;
+            if (config.is_cjk) {
+                current_command.setup_keys.replace("/editor", "/编辑");
+                current_command.keys.replace("/editor", "/编辑");
+                current_command.setup_keys.replace("é", "编");
+            }
+
+            BenchResult result = run_command(text, current_command, time_budget_ms);
+            double commands_per_second = result.total_seconds > 0 ? result.iterations / result.total_seconds : 0;
+
+            QJsonObject result_object;
+            result_object.insert("characters", config.size);
+            result_object.insert("line_length", config.line_length);
+            result_object.insert("charset", config.is_cjk ? "cjk" : "ascii");
+            result_object.insert("command", command.name);
+            result_object.insert("iterations", result.iterations);
+            result_object.insert("mean_us", result.mean_us);
+            result_object.insert("median_us", result.median_us);
+            result_object.insert("p99_us", result.p99_us);
+            result_object.insert("max_us", result.max_us);
+            result_object.insert("commands_per_second", commands_per_second);
+            results.append(result_object);
+
+            std::cerr << config.size << "\t" << config.line_length << "\t" << (config.is_cjk ? "cjk" : "ascii") << "\t"
+                      << command.name.toStdString() << "\t" << result.median_us << " us" << std::endl;
+        }
+    }
+
+    QJsonObject root;
+    root.insert("benchmark", "vim_lineedit_bench");
+    root.insert("format_version", 1);
+    root.insert("search_kernel", get_search_kernel_name(get_search_kernel()));
+    // the numbers of different versions are only comparable if they are built the same way
+    root.insert("build_type", VIM_LINEEDIT_BUILD_TYPE);
+#if defined(__OPTIMIZE__) || (defined(_MSC_VER) && !defined(_DEBUG))
+    root.insert("optimized", true);
+#else
+    root.insert("optimized", false);
+#endif
+    root.insert("results", results);
+    QByteArray json = QJsonDocument(root).toJson();
+
+    if (output_path.isEmpty()) {
+        std::cout << json.toStdString();
+    }
+    else {
+        QFile file(output_path);
+        if (!file.open(QIODevice::WriteOnly)) {
+            std::cerr << "could not open " << output_path.toStdString() << std::endl;
+            return 1;
+        }
+        file.write(json);
+    }
+
+    return 0;
+}
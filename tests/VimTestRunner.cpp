@@ -5,11 +5,14 @@
 #include <QKeyEvent>
 #include <QDebug>
 #include <iostream>
+#include <functional>
 
 #include "../VimLineEdit.h" // Assuming VimLineEdit.h is in the parent directory
 
+using SendKeyFunction = std::function<void(Qt::Key key, Qt::KeyboardModifiers modifiers, const QString &text)>;
+
 // Function to simulate keystrokes on VimLineEdit
-void simulate_keystrokes(QVimEditor::VimTextEdit *lineEdit, const QByteArray &keystrokes) {
+void simulate_keystrokes(const QByteArray &keystrokes, const SendKeyFunction &send_key) {
     int index = 0;
     int BACKSPACE_KEY = 0xfffd;
     while (index < keystrokes.length()) {
@@ -81,19 +84,7 @@ void simulate_keystrokes(QVimEditor::VimTextEdit *lineEdit, const QByteArray &ke
         // Add more key mappings as needed
 
         if (key != Qt::Key_unknown) {
-            QKeyEvent press_event(QEvent::KeyPress, key, modifiers, text_val);
-            QWidget* focus_widget = lineEdit->focusWidget();
-            if (focus_widget){
-                QApplication::sendEvent(focus_widget, &press_event);
-            }
-            else{
-                QApplication::sendEvent(lineEdit, &press_event);
-            }
-            QApplication::processEvents(); // Process events immediately
-
-            QKeyEvent release_event(QEvent::KeyRelease, key, modifiers, text_val);
-            QApplication::sendEvent(lineEdit, &release_event);
-            QApplication::processEvents(); // Process events immediately
+            send_key(key, modifiers, text_val);
         }
         index++;
     }
@@ -147,11 +138,88 @@ QString keystrokes_to_human_readable_string(QString keystrokes) {
     return result;
 }
 
+void send_key_to_widget(QVimEditor::VimTextEdit *lineEdit, Qt::Key key, Qt::KeyboardModifiers modifiers, const QString &text_val) {
+    QKeyEvent press_event(QEvent::KeyPress, key, modifiers, text_val);
+    QWidget* focus_widget = lineEdit->focusWidget();
+    if (focus_widget){
+        QApplication::sendEvent(focus_widget, &press_event);
+    }
+    else{
+        QApplication::sendEvent(lineEdit, &press_event);
+    }
+    QApplication::processEvents(); // Process events immediately
+
+    QKeyEvent release_event(QEvent::KeyRelease, key, modifiers, text_val);
+    QApplication::sendEvent(lineEdit, &release_event);
+    QApplication::processEvents(); // Process events immediately
+}
+
+// runs a single test case on a new editor and returns the resulting text
+QString run_test_case(const QByteArray &keystrokes, bool headless) {
+    if (headless) {
+        // the editor is driven directly, so there is no need to process events after each key
+        QVimEditor::InMemoryTextAdapter adapter;
+        QVimEditor::VimEditor editor(&adapter);
+        editor.set_mode(QVimEditor::VimMode::Normal);
+        simulate_keystrokes(keystrokes, [&](Qt::Key key, Qt::KeyboardModifiers modifiers, const QString &text) {
+            editor.handle_key(key, modifiers, text);
+        });
+        return adapter.get_text();
+    }
+
+    QVimEditor::VimTextEdit text_edit;
+    text_edit.editor->set_mode(QVimEditor::VimMode::Normal);
+    simulate_keystrokes(keystrokes, [&](Qt::Key key, Qt::KeyboardModifiers modifiers, const QString &text) {
+        send_key_to_widget(&text_edit, key, modifiers, text);
+    });
+    return text_edit.toPlainText();
+}
+
+void print_usage() {
+    std::cerr << "usage: vim_lineedit_tests [<test index> | --all] [--headless] [--shard <i>/<n>]" << std::endl;
+    std::cerr << "  --headless     send the keys to a VimEditor without any widgets" << std::endl;
+    std::cerr << "  --shard i/n    with --all, only run the test cases whose index modulo n is i" << std::endl;
+}
+
 int main(int argc, char *argv[]) {
     QApplication a(argc, argv);
 
-    QVimEditor::VimTextEdit line_edit;
-    line_edit.editor->set_mode(QVimEditor::VimMode::Normal);
+    bool headless = false;
+    int only_index = 52;
+    int shard_index = 0;
+    int shard_count = 1;
+
+    QStringList arguments = QCoreApplication::arguments();
+    for (int i = 1; i < arguments.size(); i++) {
+        QString argument = arguments[i];
+        if (argument == "--headless") {
+            headless = true;
+        }
+        else if (argument == "--all") {
+            only_index = -1;
+        }
+        else if (argument == "--shard" && i + 1 < arguments.size()) {
+            QStringList parts = arguments[++i].split("/");
+            bool index_ok = false, count_ok = false;
+            if (parts.size() == 2) {
+                shard_index = parts[0].toInt(&index_ok);
+                shard_count = parts[1].toInt(&count_ok);
+            }
+            if (!index_ok || !count_ok || shard_count <= 0 || shard_index < 0 || shard_index >= shard_count) {
+                std::cerr << "Invalid shard, it should be <i>/<n> with 0 <= i < n." << std::endl;
+                return 1;
+            }
+        }
+        else {
+            bool ok;
+            only_index = argument.toInt(&ok);
+            if (!ok || only_index < -1) {
+                std::cerr << "Invalid test index provided. Please provide a valid integer." << std::endl;
+                print_usage();
+                return 1;
+            }
+        }
+    }
 
     QString test_cases_path = TESTS_DIR;
 
@@ -167,25 +235,16 @@ int main(int argc, char *argv[]) {
 
     int num_passed_tests = 0;
     int num_failed_tests = 0;
-    int only_index = 52;
-    int current_test_index = 0;
-    if (argc > 1) {
-        bool ok;
-        only_index = QString(argv[1]).toInt(&ok);
-        if (!ok || only_index < 0) {
-            std::cerr << "Invalid test index provided. Please provide a valid integer." << std::endl;
-            return 1;
-        }
-    }
-
 
     for (const QFileInfo& keystrokeFile : keystrokes_file) {
 
-        current_test_index++;
         QString base_name = keystrokeFile.baseName(); // e.g., "test_case_0.keystrokes"
         QString index_str = base_name.split("_").last(); // e.g., "0"
         QString test_name = "test_case_" + index_str;
 
+        if (only_index == -1 && index_str.toInt() % shard_count != shard_index) {
+            continue;
+        }
 
         QString keystrokes_file_path = keystrokeFile.absoluteFilePath();
         QString exptected_output_file_path = test_cases_path + "/test_case_" + index_str + ".txt";
@@ -212,26 +271,21 @@ int main(int argc, char *argv[]) {
         }
 
         QByteArray keystrokes = keystrokes_file.readAll();
-        // QTextStream keystrokes_stream(&keystrokes_file);
-        // QString keystrokes = keystrokes_stream.readAll();
         keystrokes_file.close();
 
         QTextStream expected_output_stream(&expected_output_file);
         QString expected_output = expected_output_stream.readAll().trimmed();
         expected_output_file.close();
 
-        // No cleaning of keystrokes; VimLineEdit should handle all of them.
-
-        // line_edit.clear(); // Clear previous test data
-        // line_edit.setFocus(); // Ensure the widget has focus for events
-
-        simulate_keystrokes(&line_edit, keystrokes);
-
-        QString actual_output = line_edit.toPlainText();
+        // every test case gets a new editor, so the state of the previous ones doesn't leak into it
+        QString actual_output = run_test_case(keystrokes, headless);
 
         if (actual_output.trimmed() == expected_output.trimmed()) {
-            std::cout << "PASS: " << test_name.toStdString() << std::endl;
-            std::cout << "  Value: '" << actual_output.toStdString() << "'" << std::endl;
+            // when running all the tests we only report the failures
+            if (only_index != -1) {
+                std::cout << "PASS: " << test_name.toStdString() << std::endl;
+                std::cout << "  Value: '" << actual_output.toStdString() << "'" << std::endl;
+            }
             num_passed_tests++;
         } else {
             std::cout << "FAIL: " << test_name.toStdString() << std::endl;